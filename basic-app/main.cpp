@@ -102,49 +102,82 @@ void main()
 
 struct gui_resources
 {
+    std::shared_ptr<gfx::context> ctx;
     std::shared_ptr<const gfx::program> program;
     std::shared_ptr<gfx::texture> tex;
-    std::shared_ptr<gfx::mesh> mesh;
+    std::vector<std::shared_ptr<gfx::mesh>> meshes;
     draw_list list;
 
     void init_resources(std::shared_ptr<gfx::context> ctx, const sprite_sheet & sprites)
     {
+        this->ctx = ctx;
         auto vs = gfx::compile_shader(ctx, GL_VERTEX_SHADER, R"(#version 420
             layout(binding=2) uniform PerObject { vec2 u_scale, u_offset; };
             layout(location = 0) in vec2 v_position;
             layout(location = 1) in vec2 v_texcoord;
             layout(location = 2) in vec4 v_color;
-            out vec2 texcoord; out vec4 color;
+            out vec2 texcoord; out vec4 color; flat out float distance_field, layer;
             void main() 
             {
                 gl_Position = vec4(v_position * u_scale + u_offset, 0, 1);
-                texcoord = v_texcoord; color = v_color;
+                texcoord = v_texcoord * vec2(2, 8); color = v_color;
+                distance_field = texcoord.x >= 1 ? 1 : 0;
+                texcoord.x -= distance_field;
+                layer = floor(texcoord.y);
+                texcoord.y -= layer;
             })");
         auto fs = gfx::compile_shader(ctx, GL_FRAGMENT_SHADER, R"(#version 420
-            uniform sampler2D u_texture;
-            in vec2 texcoord; in vec4 color;
-            void main() { gl_FragColor = vec4(color.rgb, color.a * texture2D(u_texture, texcoord).a); })");
+            uniform sampler2DArray u_texture;
+            in vec2 texcoord; in vec4 color; flat in float distance_field, layer;
+            void main() 
+            { 
+                // Distance field sprites are thresholded at 0.5, with a ramp one pixel wide for antialiasing
+                float a = texture(u_texture, vec3(texcoord, layer)).a, w = length(vec2(dFdx(a), dFdy(a))) * 0.7;
+                if(distance_field > 0.5) a = smoothstep(0.5 - w, 0.5 + w, a);
+                gl_FragColor = vec4(color.rgb, color.a * a); 
+            })");
         program = gfx::link_program(ctx, {vs,fs});
 
         tex = gfx::create_texture(ctx);
-        gfx::set_mip_image(tex, 0, GL_ALPHA, sprites.get_texture_dims(), GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
-
-        mesh = gfx::create_mesh(ctx);
+        gfx::set_array_image(tex, 0, GL_ALPHA, sprites.get_texture_dims(), sprites.get_page_count(), GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
     }
     
-    void render_gui(const gui & g)
+    void render_gui(gui & g)
     {
-        gfx::set_indices(*mesh, GL_TRIANGLES, g.buffer.get_indices().data(), g.buffer.get_indices().size());
-        gfx::set_vertices(*mesh, g.buffer.get_vertices().data(), g.buffer.get_vertices().size() * sizeof(draw_buffer_2d::vertex));
-        gfx::set_attribute(*mesh, 0, &draw_buffer_2d::vertex::position);
-        gfx::set_attribute(*mesh, 1, &draw_buffer_2d::vertex::texcoord);
-        gfx::set_attribute(*mesh, 2, &draw_buffer_2d::vertex::color);
+        // Upload only the region of each page of the sprite sheet which changed, unless it grew or gained a page, in which case the whole sheet must be uploaded again
+        const auto & sprites = g.sprites.sheet;
+        const rect & dirty = sprites.get_dirty_rect();
+        if(dirty.x0 < dirty.x1 && dirty.y0 < dirty.y1)
+        {
+            const int2 & dims = sprites.get_texture_dims(), & pages = sprites.get_dirty_pages();
+            if(dirty.width() == dims.x && dirty.height() == dims.y) gfx::set_array_image(tex, 0, GL_ALPHA, dims, sprites.get_page_count(), GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
+            else for(int page=pages.x; page<pages.y; ++page) gfx::set_array_sub_image(tex, 0, page, dirty, GL_ALPHA, GL_UNSIGNED_BYTE, reinterpret_cast<const uint8_t *>(sprites.get_texture_data()) + (page*dims.y + dirty.y0)*dims.x + dirty.x0, dims.x);
+            g.sprites.sheet.clear_dirty_rect();
+        }
+
+        // Issue one draw per batch of the draw buffer, as each batch uses 16-bit indices relative to its own first vertex
+        const auto & batches = g.buffer.get_batches();
+        while(meshes.size() < batches.size()) meshes.push_back(gfx::create_mesh(ctx));
 
         list = {};
-        list.begin_object(mesh, program);
-        list.set_uniform("u_scale", float2(1,1)); //2.0f/g.window_size.x, -2.0f/g.window_size.y));
-        list.set_uniform("u_offset", float2(0,0)); //-1, +1));
-        list.set_sampler("u_texture", tex);
+        for(size_t i=0; i<batches.size(); ++i)
+        {
+            // If the gui produced exactly the same geometry as last frame, the meshes already hold it, and need not be uploaded again
+            auto & mesh = meshes[i];
+            if(g.buffer.is_frame_changed())
+            {
+                gfx::set_indices(*mesh, GL_TRIANGLES, batches[i].indices, batches[i].index_count);
+                gfx::set_vertices(*mesh, g.buffer.get_packed_vertices().data() + batches[i].first_vertex, batches[i].vertex_count * sizeof(draw_buffer_2d::packed_vertex));
+                gfx::set_attribute(*mesh, 0, &draw_buffer_2d::packed_vertex::position);
+                gfx::set_attribute(*mesh, 1, &draw_buffer_2d::packed_vertex::texcoord);
+                gfx::set_attribute(*mesh, 2, &draw_buffer_2d::packed_vertex::color);
+            }
+
+            list.begin_object(mesh, program);
+            list.set_uniform("u_scale", g.buffer.get_packed_position_scale());
+            list.set_uniform("u_offset", g.buffer.get_packed_position_offset());
+            list.set_sampler("u_texture", tex);
+        }
     }
 };
 
@@ -330,8 +363,8 @@ void viewport_ui(gui3D & g, int id, rect r, std::vector<scene_object *> & object
 
     if(g.mr)
     {
-        g.cam.yaw -= g.g.in.motion.x * 0.01f;
-        g.cam.pitch -= g.g.in.motion.y * 0.01f;
+        g.cam.yaw -= g.g.in.delta.x * 0.01f;
+        g.cam.pitch -= g.g.in.delta.y * 0.01f;
 
         const float4 orientation = g.cam.get_orientation();
         float3 move;
@@ -403,7 +436,10 @@ int main(int argc, char * argv[]) try
     std::set<scene_object *> selection;
     
     gui_resources gui_res;
+    g.sprites.sheet.set_max_page_count(draw_buffer_2d::max_packed_pages); // Packed texcoords can only address this many layers
+    g.sprites.load_cache("basic-app.cache");
     gui_res.init_resources(ctx, g.sprites.sheet);
+    g.buffer.set_vertex_packing(true);
 
     g3.gizmo_res.program = gfx::link_program(ctx, {compile_shader(ctx, GL_VERTEX_SHADER, diffuse_vert_shader_source), compile_shader(ctx, GL_FRAGMENT_SHADER, diffuse_frag_shader_source)});
     for(int i=0; i<9; ++i) g3.gizmo_res.meshes[i] = make_draw_mesh(ctx, g3.gizmo_res.geomeshes[i]);
@@ -411,8 +447,7 @@ int main(int argc, char * argv[]) try
     renderer the_renderer;
     
     auto win = gfx::create_window(*ctx, {1280, 720}, "Basic Workbench App");
-    std::vector<input_event> events;
-    install_input_callbacks(win, events);
+    auto & events = install_input_callbacks(win);
     glfwMakeContextCurrent(win);
     
     GLFWcursor * arrow_cursor = glfwCreateStandardCursor(GLFW_ARROW_CURSOR);
@@ -421,84 +456,97 @@ int main(int argc, char * argv[]) try
     GLFWcursor * vresize_cursor = glfwCreateStandardCursor(GLFW_VRESIZE_CURSOR);
 
     int split1 = 1080, split2 = 358, offset0 = 0, offset1 = 0;
+    static bool window_damaged = true;
+    glfwSetWindowRefreshCallback(win, [](GLFWwindow *) { window_damaged = true; });
+    bool idle = false, was_active = true;
     double t0 = glfwGetTime();
     while(!glfwWindowShouldClose(win))
     {
-        glfwPollEvents();
+        if(idle)
+        {
+            glfwWaitEvents(); // Nothing is changing, so sleep until the next input arrives, without counting the time asleep as a timestep
+            t0 = glfwGetTime();
+        }
+        else glfwPollEvents();
 
         int2 window_size, fb_size;
         glfwGetFramebufferSize(win, &fb_size.x, &fb_size.y);
         glfwGetWindowSize(win, &window_size.x, &window_size.y);
-        if(events.empty()) emit_empty_event(win);
-        g.begin_frame(window_size, events.front());
-        events.erase(begin(events));        
 
+        // Run the gui once for each event received since the last frame, so that input never backs up behind the display rate. Only the
+        // first pass advances time, and only the output of the last pass is drawn.
         const double t1 = glfwGetTime();
         g3.timestep = static_cast<float>(t1-t0);
         t0 = t1;
-        
-        g3.begin_frame();
 
-        // Experimental support for a menu bar
-        begin_menu(g, 1, {0, 0, window_size.x, 20});
+        g.begin_frame(window_size, events);
+        do
         {
-            begin_popup(g, 1, "File");
+            g3.begin_frame();
+
+            // Experimental support for a menu bar
+            begin_menu(g, 1, {0, 0, window_size.x, 20});
             {
-                begin_popup(g, 1, "New");
+                begin_popup(g, 1, "File");
                 {
-                    menu_item(g, "Game");
-                    menu_item(g, "Scene");
-                    menu_item(g, "Script");
+                    begin_popup(g, 1, "New");
+                    {
+                        menu_item(g, "Game");
+                        menu_item(g, "Scene");
+                        menu_item(g, "Script");
+                    }
+                    end_popup(g);
+                    menu_item(g, "Open", GLFW_MOD_CONTROL, GLFW_KEY_O, 0xf115);
+                    menu_item(g, "Save", GLFW_MOD_CONTROL, GLFW_KEY_S, 0xf0c7);
+                    menu_seperator(g);
+                    if(menu_item(g, "Exit", GLFW_MOD_ALT, GLFW_KEY_F4)) glfwSetWindowShouldClose(win, 1);
                 }
                 end_popup(g);
-                menu_item(g, "Open", GLFW_MOD_CONTROL, GLFW_KEY_O, 0xf115);
-                menu_item(g, "Save", GLFW_MOD_CONTROL, GLFW_KEY_S, 0xf0c7);
-                menu_seperator(g);
-                if(menu_item(g, "Exit", GLFW_MOD_ALT, GLFW_KEY_F4)) glfwSetWindowShouldClose(win, 1);
-            }
-            end_popup(g);
 
-            begin_popup(g, 2, "Edit");
-            {
-                menu_item(g, "Undo", GLFW_MOD_CONTROL, GLFW_KEY_Z, 0xf0e2);
-                menu_item(g, "Redo", GLFW_MOD_CONTROL, GLFW_KEY_Y, 0xf01e);
-                menu_seperator(g);
-                if(menu_item(g, "Cut", GLFW_MOD_CONTROL, GLFW_KEY_X, 0xf0c4)) g.clip_event = clipboard_event::cut;
-                if(menu_item(g, "Copy", GLFW_MOD_CONTROL, GLFW_KEY_C, 0xf0c5)) g.clip_event = clipboard_event::copy;
-                if(menu_item(g, "Paste", GLFW_MOD_CONTROL, GLFW_KEY_V, 0xf0ea))
+                begin_popup(g, 2, "Edit");
                 {
-                    g.clip_event = clipboard_event::paste;
-                    g.clipboard = glfwGetClipboardString(win);
+                    menu_item(g, "Undo", GLFW_MOD_CONTROL, GLFW_KEY_Z, 0xf0e2);
+                    menu_item(g, "Redo", GLFW_MOD_CONTROL, GLFW_KEY_Y, 0xf01e);
+                    menu_seperator(g);
+                    if(menu_item(g, "Cut", GLFW_MOD_CONTROL, GLFW_KEY_X, 0xf0c4)) g.clip_event = clipboard_event::cut;
+                    if(menu_item(g, "Copy", GLFW_MOD_CONTROL, GLFW_KEY_C, 0xf0c5)) g.clip_event = clipboard_event::copy;
+                    if(menu_item(g, "Paste", GLFW_MOD_CONTROL, GLFW_KEY_V, 0xf0ea))
+                    {
+                        g.clip_event = clipboard_event::paste;
+                        g.clipboard = glfwGetClipboardString(win);
+                    }
+                    menu_seperator(g);
+                    if(menu_item(g, "Select All", GLFW_MOD_CONTROL, GLFW_KEY_A, 0xf245))
+                    {
+                        selection.clear();
+                        for(auto * obj : objects) selection.insert(obj);
+                    }
                 }
-                menu_seperator(g);
-                if(menu_item(g, "Select All", GLFW_MOD_CONTROL, GLFW_KEY_A, 0xf245))
+                end_popup(g);
+
+                begin_popup(g, 3, "Help");
                 {
-                    selection.clear();
-                    for(auto * obj : objects) selection.insert(obj);
+                    menu_item(g, "View Help", GLFW_MOD_CONTROL, GLFW_KEY_F1, 0xf059);
                 }
+                end_popup(g);
             }
-            end_popup(g);
+            end_menu(g);
 
-            begin_popup(g, 3, "Help");
+            auto s = hsplitter(g, 2, {0, 21, window_size.x, window_size.y}, split1);
+            viewport_ui(g3, 3, s.first, objects, selection);
+            s = vsplitter(g, 4, s.second, split2);
+            object_list_ui(g3, 5, s.first, objects, selection, offset0);
+            object_properties_ui(g, 6, s.second, selection, offset1);
+
+            if(g.clip_event == clipboard_event::cut || g.clip_event == clipboard_event::copy)
             {
-                menu_item(g, "View Help", GLFW_MOD_CONTROL, GLFW_KEY_F1, 0xf059);
+                glfwSetClipboardString(win, g.clipboard.c_str());
             }
-            end_popup(g);
+            g3.timestep = 0;
         }
-        end_menu(g);
-
-        auto s = hsplitter(g, 2, {0, 21, window_size.x, window_size.y}, split1);
-        viewport_ui(g3, 3, s.first, objects, selection);
-        s = vsplitter(g, 4, s.second, split2);
-        object_list_ui(g3, 5, s.first, objects, selection, offset0);
-        object_properties_ui(g, 6, s.second, selection, offset1);
+        while(g.next_event());
         g.end_frame();
 
-        if(g.clip_event == clipboard_event::cut || g.clip_event == clipboard_event::copy)
-        {
-            glfwSetClipboardString(win, g.clipboard.c_str());
-        }
-
         if(is_cursor_entered(win)) switch(g.icon)
         {
         case cursor_icon::arrow: glfwSetCursor(win, arrow_cursor); break;
@@ -507,6 +555,14 @@ int main(int argc, char * argv[]) try
         case cursor_icon::vresize: glfwSetCursor(win, vresize_cursor); break;
         }
 
+        // The 3D scene only changes in response to input, or while the camera is being moved, possibly a frame later. Otherwise, if the gui
+        // produced the same frame as last time, the image already presented is still valid.
+        const bool active = g.in.type != input::none || g3.bf || g3.bl || g3.bb || g3.br;
+        const bool redraw = active || was_active || g.buffer.is_frame_changed() || window_damaged;
+        idle = !redraw && events.empty();
+        was_active = active;
+        if(!redraw) continue;
+
         const auto * per_scene = get_desc(*program).get_block_desc("PerScene");
         std::vector<byte> scene_buffer(per_scene->data_size);
         per_scene->set_uniform(scene_buffer.data(), "u_viewProj", g3.get_viewproj_matrix());
@@ -535,7 +591,9 @@ int main(int argc, char * argv[]) try
         the_renderer.draw_scene(win, {0, 0, fb_size.x, fb_size.y}, nullptr, nullptr, gui_res.list);
 
         glfwSwapBuffers(win);
+        window_damaged = false;
     }
+    g.sprites.save_cache("basic-app.cache");
     glfwTerminate();
     return EXIT_SUCCESS;
 }
@@ -177,6 +177,25 @@ void gfx::set_mip_image(std::shared_ptr<texture> tex, int mip, GLenum internalfo
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glBindTexture(GL_TEXTURE_2D, 0);
 }
+void gfx::set_array_image(std::shared_ptr<texture> tex, int mip, GLenum internalformat, const int2 & dims, int layers, GLenum format, GLenum type, const void * pixels)
+{
+    glfwMakeContextCurrent(tex->ctx->hidden);
+    if(!tex->object_name) glGenTextures(1, &tex->object_name);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex->object_name);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, mip, internalformat, dims.x, dims.y, layers, 0, format, type, pixels);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+void gfx::set_array_sub_image(std::shared_ptr<texture> tex, int mip, int layer, const rect & r, GLenum format, GLenum type, const void * pixels, int row_length)
+{
+    glfwMakeContextCurrent(tex->ctx->hidden);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex->object_name);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, mip, r.x0, r.y0, layer, r.width(), r.height(), 1, format, type, pixels);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
 void gfx::generate_mips(std::shared_ptr<texture> tex)
 {
     glfwMakeContextCurrent(tex->ctx->hidden);
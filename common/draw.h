@@ -84,6 +84,8 @@ namespace gfx
 
     std::shared_ptr<texture>    create_texture(std::shared_ptr<context> ctx);
     void                        set_mip_image       (std::shared_ptr<texture> tex, int mip, GLenum internalformat, const int2 & dims, GLenum format, GLenum type, const void * pixels);
+    void                        set_array_image     (std::shared_ptr<texture> tex, int mip, GLenum internalformat, const int2 & dims, int layers, GLenum format, GLenum type, const void * pixels); // Makes tex a GL_TEXTURE_2D_ARRAY, with layers stored one after another
+    void                        set_array_sub_image (std::shared_ptr<texture> tex, int mip, int layer, const rect & r, GLenum format, GLenum type, const void * pixels, int row_length); // Pixels points to the first pixel of r within layer, in rows of row_length pixels
     void                        generate_mips       (std::shared_ptr<texture> tex);
 
     std::shared_ptr<mesh>       create_mesh         (std::shared_ptr<context> ctx);
@@ -97,6 +99,7 @@ namespace gfx
     template<class V, int N> void set_attribute(mesh & m, int index, linalg::vec<float,N> V::* attribute) { set_attribute(m, index, N, GL_FLOAT, GL_FALSE, sizeof(V), &(static_cast<V*>(0)->*attribute)); }
     template<class V, int N> void set_attribute(mesh & m, int index, linalg::vec<short,N> V::* attribute) { set_attribute(m, index, N, GL_SHORT, GL_FALSE, sizeof(V), &(static_cast<V*>(0)->*attribute)); }
     template<class V, int N> void set_attribute(mesh & m, int index, linalg::vec<uint8_t,N> V::* attribute) { set_attribute(m, index, N, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(V), &(static_cast<V*>(0)->*attribute)); }
+    template<class V, int N> void set_attribute(mesh & m, int index, linalg::vec<uint16_t,N> V::* attribute) { set_attribute(m, index, N, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(V), &(static_cast<V*>(0)->*attribute)); }
 }
 
 // These types do not make any OpenGL calls. Lists can be freely composited in parallel, from background threads, etc.
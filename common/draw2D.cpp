@@ -3,114 +3,566 @@
 
 #include "draw2D.h"
 
-#include <cassert>  // For assert(...)
-#include <fstream>  // For std::ifstream
+#include <cassert>      // For assert(...)
+#include <algorithm>    // For std::upper_bound(...)
+#include <cstring>      // For memcpy(...)
+#include <fstream>      // For std::ifstream
+#include <atomic>       // For std::atomic<T>
+#include <exception>    // For std::exception_ptr
+#include <mutex>        // For std::mutex
+#include <thread>       // For std::thread
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>    // For CreateFileMapping(...), MapViewOfFile(...)
+#else
+#include <fcntl.h>      // For open(...)
+#include <sys/mman.h>   // For mmap(...)
+#include <sys/stat.h>   // For fstat(...)
+#include <unistd.h>     // For close(...)
+#endif
 
 #define STB_TRUETYPE_IMPLEMENTATION
 #include <stb_truetype.h>
 
-sprite_sheet::sprite_sheet()
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DRAW_2D_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Hashes a block of memory 32 bytes at a time, in four independent lanes so that the multiplies can overlap, folding the high bits of each product
+// back down so that every input bit affects the whole state
+static uint64_t hash_words(uint64_t h, const void * data, size_t size)
 {
+    auto p = reinterpret_cast<const uint8_t *>(data);
+    uint64_t lanes[4] = {h, h+1, h+2, h+3}, w[4];
+    for(; size >= sizeof(w); p += sizeof(w), size -= sizeof(w))
+    {
+        memcpy(w, p, sizeof(w));
+        for(int i=0; i<4; ++i)
+        {
+            lanes[i] = (lanes[i] ^ w[i]) * 1099511628211ULL;
+            lanes[i] ^= lanes[i] >> 32;
+        }
+    }
+    for(int i=0; i<4; ++i) h = (h ^ lanes[i]) * 1099511628211ULL;
+    for(; size; ++p, --size) h = (h ^ *p) * 1099511628211ULL;
+    return h;
+}
+
+// Cache files are written in the native byte order, and are simply discarded if they fail to match on load
+template<class T> static void write_value(std::ostream & out, const T & value) { out.write(reinterpret_cast<const char *>(&value), sizeof(T)); }
+template<class T> static void write_vector(std::ostream & out, const std::vector<T> & v) { write_value(out, static_cast<uint64_t>(v.size())); out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T)); }
+template<class T> static bool read_value(std::istream & in, T & value) { return !!in.read(reinterpret_cast<char *>(&value), sizeof(T)); }
+template<class T> static bool read_vector(std::istream & in, std::vector<T> & v)
+{
+    uint64_t size;
+    if(!read_value(in, size) || size > (1ULL << 28)) return false;
+    v.resize(static_cast<size_t>(size));
+    return !!in.read(reinterpret_cast<char *>(v.data()), v.size() * sizeof(T));
+}
+
+sprite_sheet::sprite_sheet() : lru_first(npos), lru_last(npos), frame(), frame_generation(), reclaimable(), tex_pixels(64*64), tex_dims(64, 64), max_dims(1024, 1024), max_pages(256), pages(1), dirty({0, 0, 64, 64}), dirty_pages(0, 1), generation()
+{
+    pages[0].skyline = {{1, 1, 63}};
+
     // Sprite index 0 will always be a single solid pixel, suitable for doing solid color fills
-    sprites.push_back({std::make_shared<uint8_t>(255), {1,1}});
+    insert_sprite({std::make_shared<uint8_t>(255), {1,1}});
+}
+
+size_t sprite_sheet::allocate_index(sprite s)
+{
+    if(free_indices.empty())
+    {
+        sprites.push_back(s);
+        positions.push_back({-1,-1});
+        cache_entries.push_back({npos, npos, 0, nullptr});
+        return sprites.size() - 1;
+    }
+    const size_t index = free_indices.back();
+    free_indices.pop_back();
+    sprites[index] = s;
+    return index;
 }
 
 size_t sprite_sheet::insert_sprite(sprite s)
 {
-    const size_t index = sprites.size();
-    sprites.push_back(s);
-    tex_pixels.clear();
-    tex_dims = {0,0};
+    const size_t index = allocate_index(s);
+    pending.push_back(index);
     return index;
 }
 
 void sprite_sheet::prepare_texture()
 {
-    // Sort glyphs by descending height, then descending width
-    std::vector<sprite *> glyph_list;
-    for(auto & g : sprites) glyph_list.push_back(&g);
-    std::sort(begin(glyph_list), end(glyph_list), [](const sprite * a, const sprite * b)
+    // Place the new sprites in order of descending height, then descending width, which packs a batch of sprites more tightly
+    std::stable_sort(begin(pending), end(pending), [this](size_t a, size_t b)
     {
-        return std::make_tuple(a->dims.y, a->dims.x) > std::make_tuple(b->dims.y, b->dims.x);
+        return std::make_tuple(sprites[a].dims.y, sprites[a].dims.x) > std::make_tuple(sprites[b].dims.y, sprites[b].dims.x);
     });
-
-    const int border = 1;
-    tex_dims = {64, 64};
-    while(true)
+    for(auto index : pending)
     {
-        tex_pixels.resize(tex_dims.x * tex_dims.y);
-        std::fill(begin(tex_pixels), end(tex_pixels), 0);
+        while(!pack_sprite(index))
+        {
+            const bool full_size = pages.size() > 1 || (tex_dims.x >= max_dims.x && tex_dims.y >= max_dims.y);
+            if(full_size && !fits_in_page(sprites[index].dims)) throw std::runtime_error("sprite is too large for a page of the sprite sheet");
+            if(full_size && get_page_count() >= max_pages) throw std::runtime_error("sprite sheet is full at its max page count");
+            grow_texture();
+        }
+    }
+    pending.clear();
+}
 
-        int2 used = {border, border};
-        int next_line = 0;
-        bool bad_pack = false;
-        for(auto * g : glyph_list)
+size_t sprite_sheet::cache_sprite(sprite s)
+{
+    const size_t index = allocate_index(s);
+    while(!pack_sprite(index))
+    {
+        if(pages.size() > 1 || (tex_dims.x >= max_dims.x && tex_dims.y >= max_dims.y))
         {
-            if(used.x + g->dims.x > tex_dims.x)
+            if(!fits_in_page(sprites[index].dims))
             {
-                used.x = border;
-                used.y = next_line + border;
+                sprites[index] = {};
+                free_indices.push_back(index);
+                throw std::runtime_error("sprite is too large for a page of the sprite sheet");
             }
-            if(used.x + g->dims.x > tex_dims.x || used.y + g->dims.y > tex_dims.y)
-            {
-                bad_pack = true;
-                break;
-            }
-            for(int y=0; y<g->dims.y; ++y)
+            if(reclaimable && (reclaim_free_space(), pack_sprite(index))) break;
+            sprites[index] = {};
+            free_indices.push_back(index);
+            return npos;
+        }
+        grow_texture();
+    }
+    return index;
+}
+
+size_t sprite_sheet::cache_sprite(sprite s, size_t * owner)
+{
+    // If we cannot evict enough sprites, because they have all been used this frame, add another page rather than fail to place this one
+    size_t index = cache_sprite(s);
+    while(index == npos && evict_sprites(s.dims)) index = cache_sprite(s);
+    if(index == npos)
+    {
+        index = insert_sprite(s);
+        prepare_texture();
+    }
+    track_sprite(index, owner);
+    return index;
+}
+
+void sprite_sheet::track_sprite(size_t index, size_t * owner)
+{
+    auto & e = cache_entries[index];
+    if(e.owner) unlink_sprite(index);
+    e.owner = owner;
+    *owner = index;
+    link_sprite(index);
+}
+
+void sprite_sheet::link_sprite(size_t index)
+{
+    auto & e = cache_entries[index];
+    e.prev = npos;
+    e.next = lru_first;
+    e.last_used = frame;
+    if(lru_first != npos) cache_entries[lru_first].prev = index;
+    else lru_last = index;
+    lru_first = index;
+}
+
+void sprite_sheet::unlink_sprite(size_t index)
+{
+    auto & e = cache_entries[index];
+    if(e.prev != npos) cache_entries[e.prev].next = e.next;
+    else lru_first = e.next;
+    if(e.next != npos) cache_entries[e.next].prev = e.prev;
+    else lru_last = e.prev;
+}
+
+bool sprite_sheet::evict_sprites(const int2 & dims)
+{
+    // Free several times the area of the sprite being placed, and at least a sixteenth of a page, so that the rest of a burst of new sprites
+    // usually fits without evicting and reclaiming free space again
+    const int target = std::max((dims.x+1)*(dims.y+1)*4, tex_dims.x*tex_dims.y/16);
+    int freed = 0;
+    while(freed < target && lru_last != npos && cache_entries[lru_last].last_used != frame)
+    {
+        const size_t index = lru_last;
+        freed += (sprites[index].dims.x+1)*(sprites[index].dims.y+1);
+        *cache_entries[index].owner = npos;
+        release_sprite(index);
+    }
+    if(!freed) return false;
+
+    // Anything which saw a generation assigned during this frame only refers to sprites used this frame, which are never evicted, so only
+    // the first eviction of a frame needs to invalidate texcoords cached by earlier frames
+    if(generation == frame_generation) ++generation;
+    return true;
+}
+
+bool sprite_sheet::fits_in_page(const int2 & dims) const
+{
+    // Sprites are packed from x=1 and y=1, and are followed by a one pixel gap, so an empty page holds at most tex_dims - 2
+    return dims.x + 2 <= tex_dims.x && dims.y + 2 <= tex_dims.y;
+}
+
+void sprite_sheet::erase_sprite(size_t index)
+{
+    release_sprite(index);
+    ++generation;
+}
+
+void sprite_sheet::release_sprite(size_t index)
+{
+    if(cache_entries[index].owner)
+    {
+        unlink_sprite(index);
+        cache_entries[index] = {npos, npos, 0, nullptr};
+    }
+
+    // Clear the sprite's pixels, so that they do not bleed into whichever sprite is placed next to its border
+    auto & s = sprites[index];
+    const int2 & p = positions[index];
+    const int page_index = s.page;
+    rect r = {p.x, p.y, p.x + s.dims.x + 1, p.y + s.dims.y + 1};
+    uint8_t * page_pixels = tex_pixels.data() + page_index * tex_dims.x * tex_dims.y;
+    for(int y=r.y0; y<r.y1-1; ++y) memset(page_pixels + y*tex_dims.x + r.x0, 0, s.dims.x);
+    mark_dirty(r, page_index);
+    s = {};
+    positions[index] = {-1,-1};
+    free_indices.push_back(index);
+    reclaimable = true;
+
+    // Coalesce the freed region with any free regions sharing a whole edge with it, so that larger sprites can reuse the space
+    auto & free_rects = pages[page_index].free_rects;
+    for(size_t i=0; i<free_rects.size(); )
+    {
+        const rect & f = free_rects[i];
+        if(f.y0 == r.y0 && f.y1 == r.y1 && (f.x1 == r.x0 || f.x0 == r.x1)) r = {std::min(f.x0, r.x0), r.y0, std::max(f.x1, r.x1), r.y1};
+        else if(f.x0 == r.x0 && f.x1 == r.x1 && (f.y1 == r.y0 || f.y0 == r.y1)) r = {r.x0, std::min(f.y0, r.y0), r.x1, std::max(f.y1, r.y1)};
+        else
+        {
+            ++i;
+            continue;
+        }
+        free_rects.erase(begin(free_rects) + i);
+        i = 0;
+    }
+    free_rects.push_back(r);
+}
+
+bool sprite_sheet::pack_sprite(size_t index)
+{
+    // Fill earlier pages first, so that later pages are only touched once the earlier ones are full
+    for(size_t i=0; i<pages.size(); ++i) if(pack_sprite(index, static_cast<int>(i))) return true;
+    return false;
+}
+
+bool sprite_sheet::pack_sprite(size_t index, int page_index)
+{
+    auto & s = sprites[index];
+    auto & skyline = pages[page_index].skyline;
+    auto & free_rects = pages[page_index].free_rects;
+    const int2 size = s.dims + 1; // Leave a one pixel border to the right of and below each sprite
+    int2 p;
+
+    // Prefer the smallest freed region which the sprite fits in, returning the remainder to the right of and below the sprite to the free list
+    auto best_free = end(free_rects);
+    for(auto it = begin(free_rects); it != end(free_rects); ++it)
+    {
+        if(it->width() < size.x || it->height() < size.y) continue;
+        if(best_free == end(free_rects) || it->width() * it->height() < best_free->width() * best_free->height()) best_free = it;
+    }
+    if(best_free != end(free_rects))
+    {
+        const rect r = *best_free;
+        free_rects.erase(best_free);
+        if(r.x0 + size.x < r.x1) free_rects.push_back({r.x0 + size.x, r.y0, r.x1, r.y0 + size.y});
+        if(r.y0 + size.y < r.y1) free_rects.push_back({r.x0, r.y0 + size.y, r.x1, r.y1});
+        p = {r.x0, r.y0};
+    }
+    else
+    {
+        // Otherwise, find the lowest position along the skyline where the sprite fits, preferring positions further left
+        size_t best = skyline.size();
+        int best_y = tex_dims.y;
+        for(size_t i=0; i<skyline.size() && skyline[i].x + size.x <= tex_dims.x; ++i)
+        {
+            int y = skyline[i].y;
+            for(size_t j=i+1; j<skyline.size() && skyline[j].x < skyline[i].x + size.x; ++j) y = std::max(y, skyline[j].y);
+            if(y + size.y <= tex_dims.y && y < best_y)
             {
-                memcpy(tex_pixels.data() + (used.y+y)*tex_dims.x + used.x, g->pixels.get() + y*g->dims.x, g->dims.x);
+                best = i;
+                best_y = y;
             }
-            g->s0 = static_cast<float>(used.x + g->border) / tex_dims.x;
-            g->t0 = static_cast<float>(used.y + g->border) / tex_dims.y;
-            g->s1 = static_cast<float>(used.x + g->dims.x - g->border) / tex_dims.x;
-            g->t1 = static_cast<float>(used.y + g->dims.y - g->border) / tex_dims.y;
-            used.x += g->dims.x + border;
-            next_line = std::max(next_line, used.y + g->dims.y);
         }
-        if(bad_pack)
+        if(best == skyline.size()) return false;
+
+        // Raise the skyline over the sprite, trimming the segments it covers, and merge with any neighbours of the same height
+        const int x0 = skyline[best].x, x1 = x0 + size.x;
+        size_t last = best;
+        while(last < skyline.size() && skyline[last].x + skyline[last].width <= x1) ++last;
+        if(last < skyline.size() && skyline[last].x < x1)
         {
-            if(tex_dims.x == tex_dims.y) tex_dims.x *= 2;
-            else tex_dims.y *= 2;
+            skyline[last].width -= x1 - skyline[last].x;
+            skyline[last].x = x1;
         }
-        else break;
+        skyline.erase(begin(skyline) + best, begin(skyline) + last);
+        skyline.insert(begin(skyline) + best, {x0, best_y + size.y, size.x});
+        if(best+1 < skyline.size() && skyline[best+1].y == skyline[best].y)
+        {
+            skyline[best].width += skyline[best+1].width;
+            skyline.erase(begin(skyline) + best + 1);
+        }
+        if(best > 0 && skyline[best-1].y == skyline[best].y)
+        {
+            skyline[best-1].width += skyline[best].width;
+            skyline.erase(begin(skyline) + best);
+        }
+        p = {x0, best_y};
     }
+
+    // Copy the bitmap into the texture
+    uint8_t * page_pixels = tex_pixels.data() + page_index * tex_dims.x * tex_dims.y;
+    for(int y=0; y<s.dims.y; ++y) memcpy(page_pixels + (p.y+y)*tex_dims.x + p.x, s.pixels.get() + y*s.dims.x, s.dims.x);
+    positions[index] = p;
+    s.page = page_index;
+    update_texcoords(index);
+    mark_dirty({p.x, p.y, p.x + s.dims.x, p.y + s.dims.y}, page_index);
+    return true;
 }
 
-static void compute_circle_quadrant_coverage(float coverage[], int radius)
+void sprite_sheet::reclaim_free_space()
 {
-    const float rr = static_cast<float>(radius * radius);
-    auto function = [rr](float x) { return sqrt(rr - x*x); };
-    auto antiderivative = [rr, function](float x) { return (x * function(x) + rr * atan(x/function(x))) / 2; };
-    auto integral = [antiderivative](float x0, float x1) { return antiderivative(x1) - antiderivative(x0); };
+    reclaimable = false;
 
-    for(int i=0; i<radius; ++i)
+    // Lower the skyline of each page onto the sprites which are still placed, so that freed regions at the top of each column become contiguous again
+    std::vector<int> heights(pages.size() * tex_dims.x, 1);
+    for(size_t i=0; i<sprites.size(); ++i)
     {
-        const float x0 = i+0.0f, x1 = i+1.0f;
-        const float y0 = function(x0);
-        const float y1 = function(x1);
-        const int y0i = (int)y0, y1i = (int)y1;
-
-        for(int j=i; j<y1i; ++j)
+        if(positions[i].x < 0) continue;
+        int * page_heights = heights.data() + sprites[i].page * tex_dims.x;
+        const int x1 = std::min(positions[i].x + sprites[i].dims.x + 1, tex_dims.x), y1 = positions[i].y + sprites[i].dims.y + 1;
+        for(int x=positions[i].x; x<x1; ++x) page_heights[x] = std::max(page_heights[x], y1);
+    }
+    for(size_t i=0; i<pages.size(); ++i)
+    {
+        auto & skyline = pages[i].skyline;
+        auto & free_rects = pages[i].free_rects;
+        const auto page_heights = heights.begin() + i * tex_dims.x;
+        skyline.clear();
+        for(int x=1; x<tex_dims.x; ++x)
         {
-            coverage[i*radius+j] = coverage[j*radius+i] = 1.0f;
+            if(!skyline.empty() && skyline.back().y == page_heights[x]) ++skyline.back().width;
+            else skyline.push_back({x, page_heights[x], 1});
         }
 
-        if(y0i == y1i)
+        // Keep only the parts of the free regions which are still below the skyline
+        for(size_t j=0; j<free_rects.size(); )
         {
-            float c = integral(x0, x1) - y1i*(x1-x0);
-            coverage[i*radius+y1i] = c;
-            coverage[y1i*radius+i] = c;
+            rect & f = free_rects[j];
+            f.y1 = std::min(f.y1, *std::min_element(page_heights + f.x0, page_heights + f.x1));
+            if(f.y0 < f.y1) ++j;
+            else free_rects.erase(begin(free_rects) + j);
         }
-        else
+    }
+}
+
+void sprite_sheet::grow_texture()
+{
+    // Once the first page has reached the max dims, add another page of the same size, which leaves every existing texcoord unchanged
+    if(pages.size() > 1 || (tex_dims.x >= max_dims.x && tex_dims.y >= max_dims.y))
+    {
+        pages.push_back({});
+        pages.back().skyline = {{1, 1, tex_dims.x - 1}};
+        tex_pixels.resize(pages.size() * tex_dims.x * tex_dims.y);
+        mark_dirty({0, 0, tex_dims.x, tex_dims.y}, get_page_count() - 1);
+        return;
+    }
+
+    // Otherwise, double the texture, alternating between width and height while staying within the max dims, leaving every sprite where it is
+    const int2 old_dims = tex_dims;
+    if(tex_dims.x == tex_dims.y && tex_dims.x < max_dims.x) tex_dims.x *= 2;
+    else if(tex_dims.y < max_dims.y) tex_dims.y *= 2;
+    else tex_dims.x *= 2;
+    std::vector<uint8_t> pixels(tex_dims.x * tex_dims.y);
+    for(int y=0; y<old_dims.y; ++y) memcpy(pixels.data() + y*tex_dims.x, tex_pixels.data() + y*old_dims.x, old_dims.x);
+    tex_pixels.swap(pixels);
+
+    auto & skyline = pages[0].skyline;
+    if(tex_dims.x != old_dims.x)
+    {
+        if(skyline.back().y == 1) skyline.back().width += tex_dims.x - old_dims.x;
+        else skyline.push_back({old_dims.x, 1, tex_dims.x - old_dims.x});
+    }
+    for(size_t i=0; i<sprites.size(); ++i) if(positions[i].x >= 0) update_texcoords(i);
+    dirty = {0, 0, tex_dims.x, tex_dims.y};
+    dirty_pages = {0, 1};
+    ++generation;
+}
+
+void sprite_sheet::mark_dirty(const rect & r, int page)
+{
+    if(dirty.x0 >= dirty.x1 || dirty.y0 >= dirty.y1)
+    {
+        dirty = r;
+        dirty_pages = {page, page+1};
+        return;
+    }
+    dirty = {std::min(dirty.x0, r.x0), std::min(dirty.y0, r.y0), std::max(dirty.x1, r.x1), std::max(dirty.y1, r.y1)};
+    dirty_pages = {std::min(dirty_pages.x, page), std::max(dirty_pages.y, page+1)};
+}
+
+struct sprite_record { int2 dims, position; int border, distance_field, page; };
+
+void sprite_sheet::save(std::ostream & out) const
+{
+    if(!pending.empty()) throw std::runtime_error("sprite sheet has sprites which have not been placed");
+    std::vector<sprite_record> records;
+    for(size_t i=0; i<sprites.size(); ++i) records.push_back({sprites[i].dims, positions[i], sprites[i].border, sprites[i].distance_field, sprites[i].page});
+    write_value(out, tex_dims);
+    write_value(out, static_cast<uint64_t>(pages.size()));
+    write_vector(out, tex_pixels);
+    write_vector(out, records);
+    write_vector(out, std::vector<uint64_t>(begin(free_indices), end(free_indices)));
+    for(auto & p : pages)
+    {
+        write_vector(out, p.skyline);
+        write_vector(out, p.free_rects);
+    }
+}
+
+bool sprite_sheet::load(std::istream & in)
+{
+    // Read and validate everything before modifying the sheet, so that a truncated or corrupt file leaves it unchanged
+    int2 dims;
+    uint64_t page_count;
+    std::vector<uint8_t> pixels;
+    std::vector<sprite_record> records;
+    std::vector<uint64_t> indices;
+    if(!read_value(in, dims) || !read_value(in, page_count) || !read_vector(in, pixels) || !read_vector(in, records) || !read_vector(in, indices)) return false;
+    if(dims.x <= 0 || dims.y <= 0 || page_count == 0 || page_count > static_cast<uint64_t>(max_pages) || pixels.size() != page_count * dims.x * dims.y) return false;
+    std::vector<page> new_pages(static_cast<size_t>(page_count));
+    for(auto & p : new_pages)
+    {
+        // Skylines must be non-empty runs of segments from left to right, and free regions must be non-empty, all within the page
+        if(!read_vector(in, p.skyline) || !read_vector(in, p.free_rects) || p.skyline.empty()) return false;
+        int x = 0;
+        for(auto & seg : p.skyline)
         {
-            const float cross_x = function(static_cast<float>(y0i)); // X location where curve passes from pixel y0i to pixel y1i
+            if(seg.x < x || seg.width <= 0 || seg.width > dims.x - seg.x || seg.y < 0 || seg.y > dims.y) return false;
+            x = seg.x + seg.width;
+        }
+        for(auto & f : p.free_rects) if(f.x0 < 0 || f.y0 < 0 || f.x0 >= f.x1 || f.y0 >= f.y1 || f.x1 > dims.x || f.y1 > dims.y) return false;
+    }
+    for(auto & r : records)
+    {
+        // Unplaced sprites are at (-1,-1), and placed sprites must lie within their page, leaving room for the border to their right and below them
+        if(r.position.x < 0 && r.position.y < 0) continue;
+        if(r.position.x < 0 || r.position.y < 0 || r.dims.x < 0 || r.dims.y < 0 || r.dims.x >= dims.x - r.position.x || r.dims.y >= dims.y - r.position.y) return false;
+        if(r.page < 0 || r.page >= static_cast<int>(page_count)) return false;
+    }
+    if(records.empty() || records[0].position.x < 0 || records[0].dims.x != 1 || records[0].dims.y != 1) return false; // Sprite 0 must be the solid pixel
+    std::vector<bool> freed(records.size());
+    for(auto i : indices)
+    {
+        if(i >= records.size() || records[static_cast<size_t>(i)].position.x >= 0 || freed[static_cast<size_t>(i)]) return false;
+        freed[static_cast<size_t>(i)] = true;
+    }
 
-            // Coverage for pixel at (i,y0i) is the area under the curve from x0 to cross_x
-            if(y0i < radius) coverage[i*radius+y0i] = coverage[y0i*radius+i] = integral(x0, cross_x) - y0i*(cross_x-x0);
+    // The bitmaps of the sprites are not needed once they are in the texture, so they are not restored
+    tex_dims = dims;
+    tex_pixels.swap(pixels);
+    pages.swap(new_pages);
+    sprites.resize(records.size());
+    positions.resize(records.size());
+    for(size_t i=0; i<records.size(); ++i)
+    {
+        sprites[i] = {};
+        sprites[i].dims = records[i].dims;
+        sprites[i].border = records[i].border != 0;
+        sprites[i].distance_field = records[i].distance_field != 0;
+        sprites[i].page = records[i].page;
+        positions[i] = records[i].position;
+        if(positions[i].x >= 0) update_texcoords(i);
+    }
+    free_indices.assign(begin(indices), end(indices));
+    cache_entries.assign(records.size(), {npos, npos, 0, nullptr}); // Evictable sprites must be tracked again by their owners
+    lru_first = lru_last = npos;
+    reclaimable = true;
+    pending.clear();
+    dirty = {0, 0, tex_dims.x, tex_dims.y};
+    dirty_pages = {0, get_page_count()};
+    ++generation;
+    return true;
+}
 
-            // Coverage for pixel at (i,y1i) is the area of a rectangle from x0 to cross_x, and the area under the curve from cross_x to x1
-            if(y1i == y0i - 1) coverage[i*radius+y1i] = coverage[y1i*radius+i] = (cross_x-x0) + integral(cross_x, x1) - y1i*(x1-cross_x);
-            else break; // Stop after the first octant
+void sprite_sheet::update_texcoords(size_t index)
+{
+    auto & s = sprites[index];
+    const int2 & p = positions[index];
+    s.s0 = static_cast<float>(p.x + s.border) / tex_dims.x;
+    s.t0 = static_cast<float>(p.y + s.border) / tex_dims.y + s.page;
+    s.s1 = static_cast<float>(p.x + s.dims.x - s.border) / tex_dims.x;
+    s.t1 = static_cast<float>(p.y + s.dims.y - s.border) / tex_dims.y + s.page;
+    if(s.distance_field)
+    {
+        s.s0 = -s.s0;
+        s.s1 = -s.s1;
+    }
+}
+
+static void compute_circle_quadrant_coverage(float coverage[], int radius)
+{
+    // The area of the quadrant within the pixel at column i, row j, is the integral from i to i+1 of the height of the circle above j, clamped to
+    // [0,1]. The height reaches 1 at x = edges[j+1] and 0 at x = edges[j], so with A the antiderivative of the height, the coverage is
+    // (ca - i) + (A(cb) - A(ca)) - j*(cb - ca), where ca and cb are those two crossings clamped to [i,i+1]. Tabulating A at every pixel boundary
+    // and crossing leaves only comparisons and selects per pixel, so that the pixels along the edge can be computed two at a time. A grows as r^2
+    // while the differences taken are at most 1, so everything is evaluated in double precision, or large circles would lose their edges entirely.
+    const double rr = static_cast<double>(radius) * radius;
+    auto antiderivative = [rr, radius](double x) { return (x * std::sqrt(std::max(rr - x*x, 0.0)) + rr * std::asin(std::min(x / radius, 1.0))) / 2; };
+    std::vector<double> edges(radius+1), edge_areas(radius+1), column_areas(radius+2);
+    for(int j=0; j<=radius; ++j)
+    {
+        edges[j] = std::sqrt(std::max(rr - static_cast<double>(j)*j, 0.0));
+        edge_areas[j] = antiderivative(edges[j]);
+    }
+    for(int i=0; i<radius+2; ++i) column_areas[i] = antiderivative(static_cast<double>(std::min(i, radius)));
+
+    for(int j=0; j<radius; ++j)
+    {
+        const double lo = edges[j+1], hi = edges[j], lo_area = edge_areas[j+1], hi_area = edge_areas[j], y = static_cast<double>(j);
+        float * out = coverage + j*radius;
+
+        // Pixels left of the first crossing are fully covered, and those right of the second are empty, leaving only the edge to integrate
+        const int first = std::min(static_cast<int>(lo), radius), last = std::min(static_cast<int>(std::ceil(hi)), radius);
+        std::fill(out, out + first, 1.0f);
+        std::fill(out + last, out + radius, 0.0f);
+        int i = first;
+#ifdef DRAW_2D_USE_SSE2
+        const __m128d lo2 = _mm_set1_pd(lo), hi2 = _mm_set1_pd(hi), lo_area2 = _mm_set1_pd(lo_area), hi_area2 = _mm_set1_pd(hi_area), y2 = _mm_set1_pd(y);
+        for(; i+2 <= last; i += 2)
+        {
+            const __m128d x0 = _mm_add_pd(_mm_set1_pd(i), _mm_set_pd(1, 0)), x1 = _mm_add_pd(x0, _mm_set1_pd(1));
+            const __m128d a0 = _mm_loadu_pd(column_areas.data() + i), a1 = _mm_loadu_pd(column_areas.data() + i + 1);
+            auto clamp = [&](__m128d x) { return _mm_min_pd(_mm_max_pd(x, x0), x1); };
+            auto area_at = [&](__m128d x, __m128d area)
+            {
+                const __m128d below = _mm_cmple_pd(x, x0), above = _mm_cmpge_pd(x, x1);
+                const __m128d inside = _mm_andnot_pd(_mm_or_pd(below, above), area);
+                return _mm_or_pd(inside, _mm_or_pd(_mm_and_pd(below, a0), _mm_and_pd(above, a1)));
+            };
+            const __m128d ca = clamp(lo2), cb = clamp(hi2);
+            const __m128d c = _mm_sub_pd(_mm_add_pd(_mm_sub_pd(ca, x0), _mm_sub_pd(area_at(hi2, hi_area2), area_at(lo2, lo_area2))), _mm_mul_pd(y2, _mm_sub_pd(cb, ca)));
+            _mm_storel_pi(reinterpret_cast<__m64 *>(out + i), _mm_cvtpd_ps(_mm_min_pd(_mm_max_pd(c, _mm_setzero_pd()), _mm_set1_pd(1))));
+        }
+#endif
+        for(; i<last; ++i)
+        {
+            const double x0 = static_cast<double>(i), x1 = x0 + 1;
+            auto area_at = [&](double x, double area) { return x <= x0 ? column_areas[i] : x >= x1 ? column_areas[i+1] : area; };
+            const double ca = std::min(std::max(lo, x0), x1), cb = std::min(std::max(hi, x0), x1);
+            out[i] = static_cast<float>(std::min(std::max((ca - x0) + (area_at(hi, hi_area) - area_at(lo, lo_area)) - y*(cb - ca), 0.0), 1.0));
         }
     }
 }
@@ -192,6 +644,11 @@ namespace utf8
         auto end = units + count;
         while(units != end)
         {
+#ifdef DRAW_2D_USE_SSE2
+            // Skip blocks of 16 code units at a time while none of them have their high bit set, as ASCII is always valid
+            while(end - units >= 16 && !_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(units)))) units += 16;
+            if(units == end) break;
+#endif
             auto length = get_code_length(*units++);
             if(length == 0) return false;
             for(int i=1; i<length; ++i)
@@ -202,23 +659,300 @@ namespace utf8
         }
         return true;
     }
+
+    size_t decode(const char *& units, const char * end, uint32_t * codes, size_t max_codes)
+    {
+        size_t count = 0;
+        while(units != end && count != max_codes)
+        {
+#ifdef DRAW_2D_USE_SSE2
+            // Widen blocks of 16 ASCII code units straight to codepoints, stopping at the first block containing a multibyte sequence
+            const __m128i zero = _mm_setzero_si128();
+            while(end - units >= 16 && max_codes - count >= 16)
+            {
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(units));
+                if(_mm_movemask_epi8(bytes)) break;
+                const __m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+                auto out = reinterpret_cast<__m128i *>(codes + count);
+                _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+                units += 16;
+                count += 16;
+            }
+#endif
+            // Take any remaining ASCII code units one at a time, followed by the next multibyte sequence, if any
+            while(units != end && count != max_codes && static_cast<uint8_t>(*units) < 0x80) codes[count++] = static_cast<uint8_t>(*units++);
+            if(units != end && count != max_codes)
+            {
+                codes[count++] = code(units);
+                units = next(units);
+            }
+        }
+        return count;
+    }
+}
+
+static const int distance_field_padding = 3;        // Distance fields extend this many pixels beyond the glyph, and reach 0 and 255 at that distance
+static const int distance_field_resolution = 2;     // Distance fields have this many texels per pixel, so that thin strokes survive magnification
+static const int distance_field_supersampling = 4;  // Distance fields are measured against the outline rasterized at this many samples per pixel
+
+static void distance_transform_1d(float * f, int n, int stride, float * d, int * v, float * z)
+{
+    // Lower envelope of parabolas rooted at each sample, from Felzenszwalb and Huttenlocher, "Distance Transforms of Sampled Functions"
+    int k = 0;
+    v[0] = 0;
+    z[0] = -1e20f;
+    z[1] = 1e20f;
+    for(int q=1; q<n; ++q)
+    {
+        float s;
+        while((s = ((f[q*stride] + q*q) - (f[v[k]*stride] + v[k]*v[k])) / (2*q - 2*v[k])) <= z[k]) --k;
+        v[++k] = q;
+        z[k] = s;
+        z[k+1] = 1e20f;
+    }
+    k = 0;
+    for(int q=0; q<n; ++q)
+    {
+        while(z[k+1] < q) ++k;
+        d[q] = (q-v[k])*(q-v[k]) + f[v[k]*stride];
+    }
+    for(int q=0; q<n; ++q) f[q*stride] = d[q];
+}
+
+static void distance_transform_2d(std::vector<float> & f, int width, int height)
+{
+    // Replace each sample of f, which must be either 0 or a large value, with the squared distance to the nearest sample which was 0
+    const int n = std::max(width, height);
+    std::vector<float> d(n), z(n+1);
+    std::vector<int> v(n);
+    for(int x=0; x<width; ++x) distance_transform_1d(f.data() + x, height, width, d.data(), v.data(), z.data());
+    for(int y=0; y<height; ++y) distance_transform_1d(f.data() + y*width, width, 1, d.data(), v.data(), z.data());
+}
+
+static sprite make_glyph_distance_field(const stbtt_fontinfo & info, float scale, int codepoint)
+{
+    int x0, y0, x1, y1;
+    stbtt_GetCodepointBitmapBox(&info, codepoint, scale, scale, &x0, &y0, &x1, &y1);
+    if(x0 >= x1 || y0 >= y1) return {};
+
+    // Rasterize the outline at a higher resolution, with enough margin around it to cover the padding, and find the distance from each
+    // sample to the nearest sample on the other side of the edge
+    const int k = distance_field_supersampling, margin = (distance_field_padding + 1) * k;
+    int w, h, xoff, yoff;
+    std::shared_ptr<uint8_t> outline(stbtt_GetCodepointBitmap(&info, scale*k, scale*k, codepoint, &w, &h, &xoff, &yoff), [](uint8_t * p) { stbtt_FreeBitmap(p, 0); });
+    const int gw = w + margin*2, gh = h + margin*2;
+    std::vector<float> to_inside(gw*gh, 1e20f), to_outside(gw*gh, 0.0f);
+    for(int y=0; y<h; ++y) for(int x=0; x<w; ++x) if(outline.get()[y*w+x] >= 128) std::swap(to_inside[(y+margin)*gw + x+margin], to_outside[(y+margin)*gw + x+margin]);
+    distance_transform_2d(to_inside, gw, gh);
+    distance_transform_2d(to_outside, gw, gh);
+
+    // Sample the signed distance at the center of each texel, measured in pixels
+    const int r = distance_field_resolution;
+    const int2 dims = int2(x1 - x0 + distance_field_padding*2, y1 - y0 + distance_field_padding*2) * r;
+    auto pixels = reinterpret_cast<uint8_t *>(std::malloc(dims.x * dims.y));
+    if(!pixels) throw std::bad_alloc();
+    for(int j=0; j<dims.y; ++j)
+    {
+        const int gy = std::min(std::max((y0 - distance_field_padding) * k + (j*2+1) * k / (r*2) - yoff + margin, 0), gh-1);
+        for(int i=0; i<dims.x; ++i)
+        {
+            const int gx = std::min(std::max((x0 - distance_field_padding) * k + (i*2+1) * k / (r*2) - xoff + margin, 0), gw-1);
+            const float distance = to_inside[gy*gw+gx] > 0 ? 0.5f - std::sqrt(to_inside[gy*gw+gx]) : std::sqrt(to_outside[gy*gw+gx]) - 0.5f;
+            pixels[j*dims.x+i] = static_cast<uint8_t>(std::max(std::min(128 + distance / k * 128 / distance_field_padding, 255.0f), 0.0f));
+        }
+    }
+
+    sprite s = {std::shared_ptr<uint8_t>(pixels, std::free), dims};
+    s.distance_field = true;
+    return s;
+}
+
+font_file::font_file(const uint8_t * data, size_t size, std::shared_ptr<const void> storage) : data(data), size(size), hash(hash_words(14695981039346656037ULL, data, size)), storage(move(storage)) {}
+font_file::font_file(const void * data, size_t size) : font_file(reinterpret_cast<const uint8_t *>(data), size, nullptr) {}
+
+std::shared_ptr<const font_file> font_file::open(const std::string & path)
+{
+    // Share the mapping of any file with the same path which is still in use, such as the same face loaded at another size
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<const font_file>> open_files;
+    std::lock_guard<std::mutex> lock(mutex);
+    if(auto file = open_files[path].lock()) return file;
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(handle == INVALID_HANDLE_VALUE) throw std::runtime_error("failed to open file " + path);
+    LARGE_INTEGER size = {};
+    GetFileSizeEx(handle, &size);
+    HANDLE mapping = size.QuadPart > 0 ? CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    CloseHandle(handle);
+    const void * view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if(mapping) CloseHandle(mapping);
+    if(!view) throw std::runtime_error("failed to map file " + path);
+    std::shared_ptr<const void> storage(view, [](const void * p) { UnmapViewOfFile(p); });
+    const size_t file_size = static_cast<size_t>(size.QuadPart);
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) throw std::runtime_error("failed to open file " + path);
+    struct stat status;
+    const size_t file_size = fstat(fd, &status) == 0 ? static_cast<size_t>(status.st_size) : 0;
+    void * view = file_size ? mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(view == MAP_FAILED) throw std::runtime_error("failed to map file " + path);
+    std::shared_ptr<const void> storage(view, [file_size](const void * p) { munmap(const_cast<void *>(p), file_size); });
+#endif
+
+    std::shared_ptr<const font_file> file(new font_file(reinterpret_cast<const uint8_t *>(storage.get()), file_size, storage));
+    open_files[path] = file;
+    return file;
+}
+
+struct font::face
+{
+    std::shared_ptr<const font_file> file;
+    stbtt_fontinfo info;
+    float scale;
+    int baseline;
+    std::vector<int> codepoints; // Sorted, or empty if the face provides every codepoint present in the font
+    bool distance_field;
+    uint64_t key; // Hash of the font file and every parameter affecting its glyphs
+
+    bool provides(int codepoint) const { return codepoints.empty() ? stbtt_FindGlyphIndex(&info, codepoint) != 0 : std::binary_search(begin(codepoints), end(codepoints), codepoint); }
+};
+
+font::glyph_page::glyph_page()
+{
+    for(auto & g : entries)
+    {
+        g.sprite_index = sprite_sheet::npos;
+        g.face_index = -2;
+    }
+}
+
+font::glyph_entry * font::find_glyph(int codepoint) const
+{
+    const size_t page = static_cast<uint32_t>(codepoint) >> 8;
+    if(page < pages.size() && pages[page])
+    {
+        auto & g = pages[page]->entries[codepoint & 0xFF];
+        if(g.face_index != -2) return g.face_index < 0 ? nullptr : &g;
+    }
+    else
+    {
+        if(page >= pages.size()) pages.resize(page+1);
+        pages[page].reset(new glyph_page);
+    }
+
+    // Determine which face provides this codepoint, and compute its metrics, without rasterizing it
+    auto & g = pages[page]->entries[codepoint & 0xFF];
+    g.face_index = -1;
+    for(int i=static_cast<int>(faces.size())-1; i>=0; --i) if(faces[i]->provides(codepoint)) { g.face_index = i; break; }
+    if(g.face_index < 0) return nullptr;
+
+    const face & f = *faces[g.face_index];
+    int x0, y0, x1, y1, advance;
+    stbtt_GetCodepointBitmapBox(&f.info, codepoint, f.scale, f.scale, &x0, &y0, &x1, &y1);
+    stbtt_GetCodepointHMetrics(&f.info, codepoint, &advance, nullptr);
+    g.offset = {x0, y0 + f.baseline};
+    g.dims = {x1 - x0, y1 - y0};
+    if(f.distance_field && x0 < x1 && y0 < y1)
+    {
+        g.offset -= distance_field_padding;
+        g.dims += distance_field_padding*2;
+    }
+    g.advance = static_cast<int>(std::floor(advance * f.scale));
+    return &g;
+}
+
+static sprite rasterize_glyph(const stbtt_fontinfo & info, float scale, bool distance_field, int codepoint)
+{
+    if(distance_field) return make_glyph_distance_field(info, scale, codepoint);
+    sprite s = {};
+    s.pixels = std::shared_ptr<uint8_t>(stbtt_GetCodepointBitmap(&info, 0, scale, codepoint, &s.dims.x, &s.dims.y, nullptr, nullptr), [](uint8_t * p) { stbtt_FreeBitmap(p, 0); });
+    return s;
 }
 
 const glyph_data * font::get_glyph(int codepoint) const
 {
-    auto it = glyphs.find(codepoint);
-    if(it == end(glyphs)) return nullptr;
-    return &it->second;
+    auto * g = find_glyph(codepoint);
+    if(!g) return nullptr;
+    if(g->sprite_index != sprite_sheet::npos) sprites->touch_sprite(g->sprite_index);
+    else
+    {
+        const face & f = *faces[g->face_index];
+        sprites->cache_sprite(rasterize_glyph(f.info, f.scale, f.distance_field, codepoint), &g->sprite_index);
+    }
+    return g;
+}
+
+void font::preload_glyphs(std::vector<int> codepoints) const
+{
+    // Find the glyphs which are not yet resident, in ascending order of codepoint
+    std::sort(begin(codepoints), end(codepoints));
+    codepoints.erase(std::unique(begin(codepoints), end(codepoints)), end(codepoints));
+    std::vector<std::pair<int, glyph_entry *>> missing;
+    for(auto codepoint : codepoints)
+    {
+        auto * g = find_glyph(codepoint);
+        if(g && g->sprite_index == sprite_sheet::npos) missing.push_back({codepoint, g});
+    }
+
+    // Rasterize them on as many threads as there are cores, including this one, each with its own copy of the font info, claiming glyphs from a shared counter
+    std::vector<sprite> results(missing.size());
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto work = [&]()
+    {
+        try
+        {
+            std::vector<stbtt_fontinfo> infos;
+            for(auto & f : faces) infos.push_back(f->info);
+            for(size_t i; (i = next++) < missing.size(); )
+            {
+                const face & f = *faces[missing[i].second->face_index];
+                results[i] = rasterize_glyph(infos[missing[i].second->face_index], f.scale, f.distance_field, missing[i].first);
+            }
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            error = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads(std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u) - 1, missing.size() / 16));
+    for(auto & t : threads) t = std::thread(work);
+    work();
+    for(auto & t : threads) t.join();
+    if(error) std::rethrow_exception(error);
+
+    // Place the results in the same order regardless of which thread produced them, so the layout of the sprite sheet is deterministic
+    for(size_t i=0; i<missing.size(); ++i) sprites->cache_sprite(results[i], &missing[i].second->sprite_index);
+}
+
+void font::touch_glyphs(const glyph_data * const * glyphs, size_t count) const
+{
+    for(auto end = glyphs + count; glyphs != end; ++glyphs) sprites->touch_sprite((*glyphs)->sprite_index);
+}
+
+const glyph_data * font::get_glyph_metrics(int codepoint) const
+{
+    return find_glyph(codepoint);
 }
 
 int font::get_text_width(utf8::string_view text) const
 {         
     int width = 0;
-    for(auto codepoint : text)
+    uint32_t codes[64];
+    for(auto units = text.first; units != text.last; )
     {
-        auto g = glyphs.find(codepoint);
-        if(g == end(glyphs)) continue;
-        width += g->second.advance;
+        const size_t count = utf8::decode(units, text.last, codes, 64);
+        for(size_t i=0; i<count; ++i)
+        {
+            if(auto * g = find_glyph(codes[i])) width += g->advance;
+        }
     }
     return width;
 }
@@ -227,100 +961,521 @@ std::string::size_type font::get_cursor_pos(utf8::string_view text, int x) const
 {
     for(auto it = text.begin(); it != text.end(); ++it)
     {
-        auto g = glyphs.find(*it);
-        if(g == end(glyphs)) continue;
-        if(x*2 < g->second.advance) return it.p - text.first;
-        x -= g->second.advance;
+        auto * g = find_glyph(*it);
+        if(!g) continue;
+        if(x*2 < g->advance) return it.p - text.first;
+        x -= g->advance;
     }
     return text.last - text.first;
 }
 
-void font::load_glyphs(const std::string & path, int size, const std::vector<int> & codepoints)
+void text_metrics::measure(const font & f, utf8::string_view text)
 {
-    std::ifstream in(path, std::ifstream::binary);
-    if(!in) throw std::runtime_error("failed to open file " + path);
-    in.seekg(0, std::ifstream::end);
-    std::vector<uint8_t> buffer(in.tellg());
-    in.seekg(0, std::ifstream::beg);
-    in.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
-    in.close();
+    boundaries.clear();
+    int x = 0;
+    for(auto it = text.begin(); it != text.end(); ++it)
+    {
+        // Codepoints which the font does not provide take up no space, and the caret never stops before them
+        auto * g = f.get_glyph_metrics(*it);
+        if(!g) continue;
+        boundaries.push_back({static_cast<std::string::size_type>(it.p - text.first), x});
+        x += g->advance;
+    }
+    boundaries.push_back({static_cast<std::string::size_type>(text.last - text.first), x});
+}
 
-    stbtt_fontinfo info;
-    stbtt_InitFont(&info, buffer.data(), stbtt_GetFontOffsetForIndex(buffer.data(), 0));
+int text_metrics::get_x(std::string::size_type offset) const
+{
+    auto it = std::lower_bound(begin(boundaries), end(boundaries), offset, [](const boundary & b, std::string::size_type offset) { return b.offset < offset; });
+    return it == end(boundaries) ? get_width() : it->x;
+}
+
+std::string::size_type text_metrics::get_offset(int x) const
+{
+    if(boundaries.empty()) return 0;
+
+    // Find the first codepoint whose midpoint lies to the right of x, the boundary before which is the nearest to x
+    size_t lo = 0, hi = boundaries.size() - 1;
+    while(lo < hi)
+    {
+        const size_t mid = (lo + hi) / 2;
+        if(x*2 < boundaries[mid].x + boundaries[mid+1].x) hi = mid;
+        else lo = mid + 1;
+    }
+    return boundaries[lo].offset;
+}
+
+void font::load_glyphs(std::shared_ptr<const font_file> file, int size, const std::vector<int> & codepoints, bool distance_field)
+{
+    auto f = std::make_shared<face>();
+    f->file = move(file);
+    const int offset = stbtt_GetFontOffsetForIndex(f->file->get_data(), 0);
+    if(offset < 0 || !stbtt_InitFont(&f->info, f->file->get_data(), offset)) throw std::runtime_error("invalid font file");
     int ascent, descent, line_gap;
-    stbtt_GetFontVMetrics(&info, &ascent, &descent, &line_gap);
-    float scale = stbtt_ScaleForPixelHeight(&info, static_cast<float>(size));
+    stbtt_GetFontVMetrics(&f->info, &ascent, &descent, &line_gap);
+    f->scale = stbtt_ScaleForPixelHeight(&f->info, static_cast<float>(size));
+    f->baseline = static_cast<int>(std::round(ascent * f->scale));
+    f->codepoints = codepoints;
+    std::sort(begin(f->codepoints), end(f->codepoints));
+    f->distance_field = distance_field;
+    f->key = hash_words(f->file->get_hash(), &size, sizeof(size));
+    f->key = hash_words(f->key, &distance_field, sizeof(distance_field));
+    f->key = hash_words(f->key, f->codepoints.data(), f->codepoints.size() * sizeof(int));
 
-    line_height = static_cast<int>(std::round((ascent - descent + line_gap) * scale));
-    baseline = static_cast<int>(std::round(ascent * scale));
+    line_height = static_cast<int>(std::round((ascent - descent + line_gap) * f->scale));
+    baseline = f->baseline;
 
-    for(auto codepoint : codepoints)
+    // Forget any glyphs which this face now provides instead. Entries are reset rather than freed, as text runs may still point at them.
+    for(size_t page=0; page<pages.size(); ++page)
+    {
+        if(!pages[page]) continue;
+        for(int i=0; i<256; ++i)
+        {
+            auto & g = pages[page]->entries[i];
+            if(g.face_index == -2 || !f->provides(static_cast<int>(page << 8) + i)) continue;
+            if(g.sprite_index != sprite_sheet::npos) sprites->erase_sprite(g.sprite_index);
+            g.sprite_index = sprite_sheet::npos;
+            g.face_index = -2;
+        }
+    }
+    faces.push_back(f);
+}
+
+void font::load_glyphs(std::shared_ptr<const font_file> file, int size, bool distance_field)
+{
+    load_glyphs(move(file), size, {}, distance_field);
+}
+
+struct glyph_record { int codepoint, face_index; uint64_t sprite_index; int2 offset, dims; int advance; };
+
+uint64_t font::get_cache_key() const
+{
+    uint64_t key = 14695981039346656037ULL;
+    for(auto & f : faces) key = hash_words(key, &f->key, sizeof(f->key));
+    return key;
+}
+
+void font::save(std::ostream & out) const
+{
+    std::vector<glyph_record> records;
+    for(size_t page=0; page<pages.size(); ++page)
     {
-        glyph_data & g = glyphs[codepoint];
+        if(!pages[page]) continue;
+        for(int i=0; i<256; ++i)
+        {
+            const auto & g = pages[page]->entries[i];
+            if(g.face_index != -2) records.push_back({static_cast<int>(page << 8) + i, g.face_index, g.sprite_index, g.offset, g.dims, g.advance});
+        }
+    }
+    write_vector(out, records);
+}
 
-        sprite s = {};
-        s.pixels = std::shared_ptr<uint8_t>(stbtt_GetCodepointBitmap(&info, 0, scale, codepoint, &s.dims.x, &s.dims.y, &g.offset.x, &g.offset.y), [](uint8_t * p) { stbtt_FreeBitmap(p, 0); });
-        g.sprite_index = sprites->insert_sprite(s);
+bool font::load(std::istream & in, sprite_sheet & sheet, std::vector<bool> & unclaimed)
+{
+    std::vector<glyph_record> records;
+    if(!read_vector(in, records)) return false;
+    for(auto & r : records)
+    {
+        if(r.codepoint < 0 || r.codepoint >= 0x110000 || r.face_index < -1 || r.face_index >= static_cast<int>(faces.size())) return false;
+        if(r.sprite_index == sprite_sheet::npos) continue;
+        if(r.sprite_index >= unclaimed.size() || !unclaimed[static_cast<size_t>(r.sprite_index)]) return false;
+        unclaimed[static_cast<size_t>(r.sprite_index)] = false;
+    }
 
-        int advance;
-        stbtt_GetCodepointHMetrics(&info, codepoint, &advance, nullptr);
-        g.offset.y += baseline;
-        g.advance = static_cast<int>(std::floor(advance * scale));
+    // Reset the existing entries in place, as text runs may still point at them
+    for(auto & page : pages)
+    {
+        if(!page) continue;
+        for(auto & g : page->entries)
+        {
+            g.sprite_index = sprite_sheet::npos;
+            g.face_index = -2;
+        }
     }
+    for(auto & r : records)
+    {
+        const size_t page = static_cast<size_t>(r.codepoint) >> 8;
+        if(page >= pages.size()) pages.resize(page+1);
+        if(!pages[page]) pages[page].reset(new glyph_page);
+        auto & g = pages[page]->entries[r.codepoint & 0xFF];
+        g.face_index = r.face_index;
+        g.sprite_index = static_cast<size_t>(r.sprite_index);
+        g.offset = r.offset;
+        g.dims = r.dims;
+        g.advance = r.advance;
+        if(g.sprite_index != sprite_sheet::npos) sheet.track_sprite(g.sprite_index, &g.sprite_index);
+    }
+    return true;
 }
 
-sprite_library::sprite_library() : default_font(&sheet)
+sprite_library::sprite_library(const std::string & font_path) : default_font(&sheet)
 {
     std::vector<int> codepoints;
     for(int i=32; i<256; ++i) codepoints.push_back(i);
-    default_font.load_glyphs("c:/windows/fonts/arialbd.ttf", 14, codepoints);
-    for(int i=1; i<=32; ++i) corner_sprites[i] = sheet.insert_sprite(make_circle_quadrant(i));
-    for(int i=1; i<=8; ++i)
+    default_font.load_glyphs(font_path, 14, codepoints);
+    sheet.prepare_texture();
+}
+
+static sprite make_line_cross_section(int width)
+{
+    auto pixels = reinterpret_cast<uint8_t *>(std::malloc(width+2));
+    if(!pixels) throw std::bad_alloc();
+    sprite s = {std::shared_ptr<uint8_t>(pixels, std::free), {width+2,1}};
+    memset(pixels+1, 255, width);
+    pixels[0] = pixels[width+1] = 0;
+    return s;
+}
+
+static size_t place_shape_sprite(sprite_sheet & sheet, std::map<int, size_t> & sprites, int size, sprite (* make_sprite)(int))
+{
+    // Sizes are clamped by the callers, so the map stays small even though evicted shapes leave npos entries behind
+    auto & index = sprites.insert(std::make_pair(size, sprite_sheet::npos)).first->second;
+    if(index != sprite_sheet::npos) sheet.touch_sprite(index);
+    else sheet.cache_sprite(make_sprite(size), &index);
+    return index;
+}
+
+size_t sprite_library::get_corner_sprite(int radius) const
+{
+    // The sprite is two pixels wider than the radius, and a page holds sprites at most two pixels narrower than itself
+    const int2 & max_dims = sheet.get_max_texture_dims();
+    return place_shape_sprite(sheet, corner_sprites, std::min(std::max(radius, 1), std::min(max_dims.x, max_dims.y) - 4), make_circle_quadrant);
+}
+
+size_t sprite_library::get_line_sprite(int width) const
+{
+    return place_shape_sprite(sheet, line_sprites, std::min(std::max(width, 1), sheet.get_max_texture_dims().x - 4), make_line_cross_section);
+}
+
+static const char cache_magic[4] = {'S','P','R','C'};
+static const uint32_t cache_version = 3;
+
+static void write_shape_sprites(std::ostream & out, const std::map<int, size_t> & sprites)
+{
+    std::vector<uint64_t> values;
+    for(auto & p : sprites)
     {
-        auto pixels = reinterpret_cast<uint8_t *>(std::malloc(i+2));
-        if(!pixels) throw std::bad_alloc();
-        sprite s = {std::shared_ptr<uint8_t>(pixels, std::free), {i+2,1}};
-        memset(pixels+1, 255, i);
-        pixels[0] = pixels[i+1] = 0;
-        line_sprites[i] = sheet.insert_sprite(s);
+        if(p.second == sprite_sheet::npos) continue;
+        values.push_back(static_cast<uint64_t>(p.first));
+        values.push_back(static_cast<uint64_t>(p.second));
     }
-    sheet.prepare_texture();
+    write_vector(out, values);
+}
+
+static bool read_shape_sprites(std::istream & in, std::map<int, size_t> & sprites, std::vector<bool> & unclaimed)
+{
+    std::vector<uint64_t> values;
+    if(!read_vector(in, values) || values.size() % 2) return false;
+    for(size_t i=0; i<values.size(); i+=2)
+    {
+        if(values[i] == 0 || values[i] > 0x10000 || values[i+1] >= unclaimed.size() || !unclaimed[static_cast<size_t>(values[i+1])]) return false;
+        unclaimed[static_cast<size_t>(values[i+1])] = false;
+        sprites[static_cast<int>(values[i])] = static_cast<size_t>(values[i+1]);
+    }
+    return true;
+}
+
+uint64_t sprite_library::get_cache_key() const
+{
+    return default_font.get_cache_key();
+}
+
+bool sprite_library::load_cache(const std::string & path)
+{
+    std::ifstream in(path, std::ifstream::binary);
+    if(!in) return false;
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    if(!read_value(in, magic) || memcmp(magic, cache_magic, sizeof(magic)) != 0 || !read_value(in, version) || version != cache_version) return false;
+    if(!read_value(in, key) || key != get_cache_key()) return false;
+
+    // Load into a copy of the sheet, and only replace ours once the shapes and glyphs have been loaded too
+    sprite_sheet s = sheet;
+    std::map<int, size_t> corners, lines;
+    if(!s.load(in)) return false;
+
+    // Every shape and glyph must refer to a sprite of its own which is actually in the texture, and none may claim the solid pixel
+    std::vector<bool> unclaimed(s.get_sprite_count());
+    for(size_t i=1; i<unclaimed.size(); ++i) unclaimed[i] = s.is_placed(i);
+    if(!read_shape_sprites(in, corners, unclaimed) || !read_shape_sprites(in, lines, unclaimed)) return false;
+    if(!default_font.load(in, s, unclaimed)) return false;
+    // Swapping the maps below keeps their nodes in place, so the sheet can refer to the entries it must clear on eviction
+    for(auto & p : corners) s.track_sprite(p.second, &p.second);
+    for(auto & p : lines) s.track_sprite(p.second, &p.second);
+    sheet = std::move(s);
+    corner_sprites.swap(corners);
+    line_sprites.swap(lines);
+    return true;
+}
+
+void sprite_library::save_cache(const std::string & path) const
+{
+    std::ofstream out(path, std::ofstream::binary);
+    if(!out) throw std::runtime_error("failed to open file " + path);
+    write_value(out, cache_magic);
+    write_value(out, cache_version);
+    write_value(out, get_cache_key());
+    sheet.save(out);
+    write_shape_sprites(out, corner_sprites);
+    write_shape_sprites(out, line_sprites);
+    default_font.save(out);
+}
+
+void draw_buffer_2d::reset()
+{
+    // Evict cached text runs which were not drawn during the previous frame
+    for(auto it = begin(text_runs); it != end(text_runs); )
+    {
+        if(it->second.last_frame != frame_index) it = text_runs.erase(it);
+        else ++it;
+    }
+    ++frame_index;
+
+    vertices.clear();
+    batch_starts = {0};
+    primitive_starts.clear();
+    for(auto & l : levels)
+    {
+        l.indices.clear();
+        l.segments.clear();
+    }
+    if(levels.empty()) levels.resize(1);
+    current_level = 0;
 }
 
 void draw_buffer_2d::begin_frame(const sprite_library & library, const int2 & window_size)
 {
+    reset();
     this->library = &library;
-    vertices.clear();
-    indices.clear();
-    lists = {{0, 0}};
+    std::lock_guard<std::mutex> lock(library.mutex);
+    library.sheet.begin_frame();
+    texture_dims = library.sheet.get_texture_dims();
+    const auto & white = library.sheet.get_sprite(0);
+    white_texcoord = {(white.s0+white.s1)/2, (white.t0+white.t1)/2};
+    record_primitives = false;
     scissor = {{0, 0, window_size.x, window_size.y}};
     transforms = {{1}};
     a = {2.0f / window_size.x, -2.0f / window_size.y};
     b = {-1, +1};
 }
 
+void draw_buffer_2d::begin_frame(const draw_buffer_2d & parent)
+{
+    // Inherit the parent's state, and record where each primitive begins, so that append() can reproduce the parent's batch boundaries
+    reset();
+    library = parent.library;
+    record_primitives = true;
+    scissor = parent.scissor;
+    transforms = parent.transforms;
+    a = parent.a;
+    b = parent.b;
+    texture_dims = parent.texture_dims;
+    white_texcoord = parent.white_texcoord;
+}
+
+void draw_buffer_2d::append(const draw_buffer_2d & sub)
+{
+    // Replay the batch boundary decisions which would have been made had each primitive been recorded directly into this buffer
+    {
+        std::lock_guard<std::mutex> lock(library->mutex);
+        sync_texture_dims();
+    }
+    const size_t offset = vertices.size();
+    for(size_t i=0; i<sub.primitive_starts.size(); ++i)
+    {
+        const size_t first = offset + sub.primitive_starts[i], last = offset + (i+1 < sub.primitive_starts.size() ? sub.primitive_starts[i+1] : sub.vertices.size());
+        if(last > batch_starts.back() + 0x10000) batch_starts.push_back(first);
+        if(record_primitives) primitive_starts.push_back(first);
+    }
+    vertices.insert(end(vertices), begin(sub.vertices), end(sub.vertices));
+    if(sub.texture_dims.x != texture_dims.x || sub.texture_dims.y != texture_dims.y)
+    {
+        // The sprite sheet grew while the sub-buffer was being recorded, so bring its texcoords up to date
+        const float2 scale = float2(sub.texture_dims) / float2(texture_dims);
+        for(auto it = begin(vertices) + offset; it != end(vertices); ++it) it->texcoord = it->texcoord * scale;
+    }
+
+    // Rebase each index against whichever of our batches its vertex now falls into, with the sub-buffer's levels stacked on our current level
+    const auto first_batch = std::upper_bound(begin(batch_starts), end(batch_starts), offset) - 1;
+    if(current_level + sub.levels.size() > levels.size()) levels.resize(current_level + sub.levels.size());
+    for(size_t i=0; i<sub.levels.size(); ++i)
+    {
+        const auto & src = sub.levels[i];
+        auto & dst = levels[current_level + i];
+        auto batch = first_batch;
+        for(size_t j=0; j<src.segments.size(); ++j)
+        {
+            const auto & seg = src.segments[j];
+            const size_t last = j+1 < src.segments.size() ? src.segments[j+1].first : src.indices.size();
+            for(size_t k=seg.first; k<last; ++k)
+            {
+                const size_t vertex = offset + seg.base_vertex + src.indices[k];
+                while(batch+1 != end(batch_starts) && batch[1] <= vertex) ++batch;
+                if(dst.segments.empty() || dst.segments.back().base_vertex != *batch) dst.segments.push_back({*batch, dst.indices.size()});
+                dst.indices.push_back(static_cast<uint16_t>(vertex - *batch));
+            }
+        }
+    }
+}
+
 void draw_buffer_2d::end_frame()
 {
-    lists.back().last = indices.size();
-    std::stable_sort(begin(lists), end(lists), [](const list & a, const list & b) { return a.level < b.level; });
+    std::unique_lock<std::mutex> lock(library->mutex);
+    sync_texture_dims();
+    const int page_count = library->sheet.get_page_count();
+    sheet_generation = library->sheet.get_texture_generation();
+    lock.unlock();
+
+    // Indices were recorded directly into per-level storage, so each segment of each level can be drawn in place, in level order
+    batches.clear();
+    for(auto & l : levels)
+    {
+        for(size_t i=0; i<l.segments.size(); ++i)
+        {
+            const auto & seg = l.segments[i];
+            const size_t last = i+1 < l.segments.size() ? l.segments[i+1].first : l.indices.size();
+            if(seg.first == last) continue;
+            const auto next_start = std::upper_bound(begin(batch_starts), end(batch_starts), seg.base_vertex);
+            batches.push_back({seg.base_vertex, (next_start == end(batch_starts) ? vertices.size() : *next_start) - seg.base_vertex, l.indices.data() + seg.first, last - seg.first});
+        }
+    }
 
-    out_indices.clear();
-    out_indices.reserve(indices.size());
-    for(auto & list : lists) out_indices.insert(end(out_indices), indices.data() + list.first, indices.data() + list.last);
+    if(pack_vertices)
+    {
+        if(page_count > max_packed_pages) throw std::runtime_error("sprite sheet has more pages than packed vertices can address");
+
+        // Convert positions from normalized device coordinates back to quarter pixels, and texcoords and colors to normalized integers,
+        // moving the texcoords of distance field sprites from negative s into [1,2), and keeping the page in t, which spans [0,8)
+        const float2 position_scale = 4.0f / a;
+        packed_vertices.resize(vertices.size());
+        auto out = packed_vertices.data();
+        for(auto & v : vertices)
+        {
+            const float2 position = (v.position - b) * position_scale;
+            out->position = {static_cast<short>(std::max(std::min(std::round(position.x), 32767.0f), -32768.0f)), static_cast<short>(std::max(std::min(std::round(position.y), 32767.0f), -32768.0f))};
+            const float2 texcoord = {v.texcoord.x < 0 ? 1 - v.texcoord.x : v.texcoord.x, v.texcoord.y};
+            out->texcoord = {static_cast<uint16_t>(std::round(std::max(std::min(texcoord.x, 2.0f), 0.0f) * 32767.5f)), static_cast<uint16_t>(std::round(std::max(std::min(texcoord.y, 8.0f), 0.0f) * 8191.875f))};
+            for(int i=0; i<4; ++i) out->color[i] = static_cast<uint8_t>(std::round(std::max(std::min(v.color[i], 1.0f), 0.0f) * 255));
+            ++out;
+        }
+    }
+
+    // Hash everything which reaches the GPU, so that callers can skip uploading and presenting a frame identical to the last one
+    uint64_t hash = hash_words(14695981039346656037ULL, &a, sizeof(a));
+    hash = hash_words(hash, &b, sizeof(b));
+    hash = hash_words(hash, &sheet_generation, sizeof(sheet_generation));
+    if(pack_vertices) hash = hash_words(hash, packed_vertices.data(), packed_vertices.size() * sizeof(packed_vertex));
+    else hash = hash_words(hash, vertices.data(), vertices.size() * sizeof(vertex));
+    for(auto & batch : batches)
+    {
+        const size_t range[] = {batch.first_vertex, batch.vertex_count, batch.index_count};
+        hash = hash_words(hash, range, sizeof(range));
+        hash = hash_words(hash, batch.indices, batch.index_count * sizeof(uint16_t));
+    }
+    frame_changed = hash != frame_hash;
+    frame_hash = hash;
+
+    if(track_damage) compute_damage();
+    else damage = {scissor.front()};
+}
+
+void draw_buffer_2d::compute_damage()
+{
+    // Hash each triangle, and mix it into every tile its bounds overlap, in the order in which the triangles will be drawn. The texture generation
+    // is mixed into every triangle, as evicting a sprite can change what a triangle samples without changing its vertices.
+    const uint64_t generation_salt = (static_cast<uint64_t>(sheet_generation) + 1) * 0x9E3779B97F4A7C15ULL;
+    const rect & window = scissor.front();
+    const int2 tiles = {(window.x1 + damage_tile_size - 1) / damage_tile_size, (window.y1 + damage_tile_size - 1) / damage_tile_size};
+    const bool resized = window.x1 != damage_window_size.x || window.y1 != damage_window_size.y || tile_hashes.empty();
+    std::swap(tile_hashes, previous_tile_hashes);
+    tile_hashes.assign(tiles.x * tiles.y, 14695981039346656037ULL);
+    damage_window_size = window.dims();
+
+    // Vertices are all 32 bytes, so they can be hashed with a few independent multiplies, and converted back to tile coordinates in the same pass
+    const float2 tile_scale = 1.0f / (a * static_cast<float>(damage_tile_size));
+    damage_vertices.resize(vertices.size());
+    for(size_t i=0; i<vertices.size(); ++i)
+    {
+        uint64_t w[4];
+        memcpy(w, &vertices[i], sizeof(w));
+        uint64_t h = (w[0] * 0x9E3779B97F4A7C15ULL) ^ ((w[1] * 0xC2B2AE3D27D4EB4FULL) >> 21 | (w[1] * 0xC2B2AE3D27D4EB4FULL) << 43) ^ ((w[2] * 0x165667B19E3779F9ULL) >> 42 | (w[2] * 0x165667B19E3779F9ULL) << 22) ^ (w[3] * 0x27D4EB2F165667C5ULL);
+        h ^= h >> 29;
+        damage_vertices[i] = {(vertices[i].position - b) * tile_scale, h * 0x9E3779B97F4A7C15ULL};
+    }
+    for(auto & batch : batches)
+    {
+        const damage_vertex * v = damage_vertices.data() + batch.first_vertex;
+        for(auto tri = batch.indices, end = batch.indices + batch.index_count; tri != end; tri += 3)
+        {
+            const damage_vertex & v0 = v[tri[0]], & v1 = v[tri[1]], & v2 = v[tri[2]];
+            const float2 lo = max(min(min(v0.tile, v1.tile), v2.tile), float2(0,0)), hi = max(max(max(v0.tile, v1.tile), v2.tile), float2(0,0));
+            const int x0 = static_cast<int>(lo.x), x1 = std::min(static_cast<int>(hi.x), tiles.x - 1);
+            const int y0 = static_cast<int>(lo.y), y1 = std::min(static_cast<int>(hi.y), tiles.y - 1);
+            const uint64_t h = (((v0.hash * 1099511628211ULL) ^ v1.hash) * 1099511628211ULL ^ v2.hash) ^ generation_salt;
+            for(int y=y0; y<=y1; ++y)
+            {
+                for(int x=x0; x<=x1; ++x)
+                {
+                    auto & t = tile_hashes[y*tiles.x+x];
+                    t = (t ^ h) * 1099511628211ULL;
+                    t ^= t >> 32;
+                }
+            }
+        }
+    }
+
+    // If the window was resized, everything is damaged. Otherwise, merge runs of changed tiles in each row, and extend those which exactly
+    // continue a run from the row above downwards, to produce a small set of disjoint rectangles.
+    damage.clear();
+    if(resized)
+    {
+        damage.push_back(window);
+        return;
+    }
+    for(int y=0; y<tiles.y; ++y)
+    {
+        for(int x=0; x<tiles.x; ++x)
+        {
+            if(tile_hashes[y*tiles.x+x] == previous_tile_hashes[y*tiles.x+x]) continue;
+            const int x0 = x;
+            while(x+1 < tiles.x && tile_hashes[y*tiles.x+x+1] != previous_tile_hashes[y*tiles.x+x+1]) ++x;
+            const rect r = {x0 * damage_tile_size, y * damage_tile_size, std::min((x+1) * damage_tile_size, window.x1), std::min((y+1) * damage_tile_size, window.y1)};
+            auto it = std::find_if(begin(damage), end(damage), [&r](const rect & d) { return d.x0 == r.x0 && d.x1 == r.x1 && d.y1 == r.y0; });
+            if(it != end(damage)) it->y1 = r.y1;
+            else damage.push_back(r);
+        }
+    }
 }
 
 void draw_buffer_2d::begin_overlay()
 {
-    lists.back().last = indices.size();
-    lists.push_back({lists.back().level + 1, indices.size()});
+    if(++current_level == levels.size()) levels.resize(current_level + 1);
     scissor.push_back(scissor.front()); // Overlays are not constrained by parent scissor rect
 }
 
 void draw_buffer_2d::end_overlay()
 {
     scissor.pop_back();
-    lists.back().last = indices.size();
-    lists.push_back({lists.back().level - 1, indices.size()});
+    --current_level;
+}
+
+void draw_buffer_2d::begin_batch()
+{
+    batch_starts.push_back(vertices.size());
+}
+
+void draw_buffer_2d::begin_primitive(size_t n)
+{
+    if(vertices.size() + n > batch_starts.back() + 0x10000) begin_batch(); // Indices are 16-bit, so start a new batch rather than overflow
+    if(record_primitives && n) primitive_starts.push_back(vertices.size());
+}
+
+std::vector<uint16_t> & draw_buffer_2d::begin_indices()
+{
+    auto & l = levels[current_level];
+    if(l.segments.empty() || l.segments.back().base_vertex != batch_starts.back()) l.segments.push_back({batch_starts.back(), l.indices.size()});
+    return l.indices;
 }
 
 void draw_buffer_2d::begin_scissor(const rect & r)
@@ -361,6 +1516,20 @@ static size_t clip_polygon(draw_buffer_2d::vertex (& out)[8], const draw_buffer_
     return out_size;
 }
 
+void draw_buffer_2d::emit_polygon(const vertex * polygon, size_t n)
+{
+    begin_primitive(n);
+    const uint16_t base = static_cast<uint16_t>(vertices.size() - batch_starts.back());
+    auto & indices = begin_indices();
+    for(uint16_t i=2; i<n; ++i)
+    {
+        indices.push_back(base);
+        indices.push_back(base+i-1);
+        indices.push_back(base+i);
+    }
+    for(auto it = polygon, end = polygon + n; it != end; ++it) vertices.push_back({it->position * this->a + this->b, it->texcoord, it->color});
+}
+
 void draw_buffer_2d::draw_quad(const vertex & v0, const vertex & v1, const vertex & v2, const vertex & v3)
 {
     vertex a[8] = {v0, v1, v2, v3}, b[8]; size_t n = 4;
@@ -369,56 +1538,210 @@ void draw_buffer_2d::draw_quad(const vertex & v0, const vertex & v1, const verte
     n = clip_polygon(a, b, n, float3( 0, +1, static_cast<float>(-scissor.back().y0)));
     n = clip_polygon(b, a, n, float3(-1,  0, static_cast<float>(+scissor.back().x1)));
     n = clip_polygon(a, b, n, float3( 0, -1, static_cast<float>(+scissor.back().y1)));
-    if(vertices.size() + n > 0x10000) throw std::runtime_error("draw buffer overflow");
-    const uint16_t base = static_cast<uint16_t>(vertices.size());
-    for(uint16_t i=2; i<n; ++i)
+    emit_polygon(a, n);
+}
+
+// The sprite kernels below write four vertices per visible sprite, and return a pointer just past the last vertex written. Our transforms only
+// scale and translate, so sprites remain axis-aligned, and can be clipped against the scissor rect by intersection, remapping texcoords to match.
+#ifndef DRAW_2D_USE_SSE2
+static draw_buffer_2d::vertex * emit_sprites_scalar(draw_buffer_2d::vertex * out, const float4 * quads, size_t count, const transform_2d & t, const rect & sr, const float2 & a, const float2 & b, const float4 & color)
+{
+    for(auto end = quads + count*2; quads != end; quads += 2)
     {
-        indices.push_back(base);
-        indices.push_back(base+i-1);
-        indices.push_back(base+i);
+        float2 p0 = t.transform_point(quads[0].xy()), p1 = t.transform_point(float2(quads[0].z, quads[0].w));
+        float s0 = quads[1].x, t0 = quads[1].y, s1 = quads[1].z, t1 = quads[1].w;
+
+        // Trivially reject sprites which are empty or lie entirely outside the scissor rect
+        if(p0.x >= p1.x || p0.y >= p1.y || p1.x <= sr.x0 || p1.y <= sr.y0 || p0.x >= sr.x1 || p0.y >= sr.y1) continue;
+
+        // Clip partially visible sprites against each edge of the scissor rect
+        if(p0.x < sr.x0) { s0 += (s1 - s0) * (sr.x0 - p0.x) / (p1.x - p0.x); p0.x = static_cast<float>(sr.x0); }
+        if(p0.y < sr.y0) { t0 += (t1 - t0) * (sr.y0 - p0.y) / (p1.y - p0.y); p0.y = static_cast<float>(sr.y0); }
+        if(p1.x > sr.x1) { s1 += (s1 - s0) * (sr.x1 - p1.x) / (p1.x - p0.x); p1.x = static_cast<float>(sr.x1); }
+        if(p1.y > sr.y1) { t1 += (t1 - t0) * (sr.y1 - p1.y) / (p1.y - p0.y); p1.y = static_cast<float>(sr.y1); }
+
+        p0 = p0 * a + b;
+        p1 = p1 * a + b;
+        *out++ = {{p0.x, p0.y}, {s0,t0}, color};
+        *out++ = {{p1.x, p0.y}, {s1,t0}, color};
+        *out++ = {{p1.x, p1.y}, {s1,t1}, color};
+        *out++ = {{p0.x, p1.y}, {s0,t1}, color};
+    }
+    return out;
+}
+#else
+static draw_buffer_2d::vertex * emit_sprites_sse2(draw_buffer_2d::vertex * out, const float4 * quads, size_t count, const transform_2d & t, const rect & sr, const float2 & a, const float2 & b, const float4 & color)
+{
+    static_assert(sizeof(draw_buffer_2d::vertex) == 32, "position and texcoord must be stored as four consecutive floats, followed by color");
+    const __m128 scale = _mm_set1_ps(t.scale), translate = _mm_setr_ps(t.translate.x, t.translate.y, t.translate.x, t.translate.y);
+    const __m128 scissor = _mm_cvtepi32_ps(_mm_setr_epi32(sr.x0, sr.y0, sr.x1, sr.y1));
+    const __m128 ndc_scale = _mm_setr_ps(a.x, a.y, a.x, a.y), ndc_offset = _mm_setr_ps(b.x, b.y, b.x, b.y);
+    const __m128 col = _mm_loadu_ps(&color.x);
+    for(auto end = quads + count*2; quads != end; quads += 2)
+    {
+        // Transform bounds to window coordinates, and form the swapped vector (x1,y1,x0,y0)
+        const __m128 bounds = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&quads[0].x), scale), translate);
+        const __m128 swapped = _mm_shuffle_ps(bounds, bounds, _MM_SHUFFLE(1,0,3,2));
+
+        // Reject if x0 >= x1 or y0 >= y1, if x1 <= scissor.x0 or y1 <= scissor.y0, or if x0 >= scissor.x1 or y0 >= scissor.y1
+        if((_mm_movemask_ps(_mm_cmpge_ps(bounds, swapped)) & 3) != 0) continue;
+        if((_mm_movemask_ps(_mm_cmple_ps(swapped, scissor)) & 3) != 0) continue;
+        if((_mm_movemask_ps(_mm_cmpge_ps(swapped, scissor)) & 12) != 0) continue;
+
+        // Intersect with the scissor rect, remapping texcoords only if some edge actually moved
+        const __m128 lo = _mm_max_ps(bounds, scissor), hi = _mm_min_ps(bounds, scissor);
+        const __m128 clipped = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3,2,1,0));
+        __m128 texcoords = _mm_loadu_ps(&quads[1].x);
+        if(_mm_movemask_ps(_mm_cmpneq_ps(clipped, bounds)))
+        {
+            const __m128 swapped_texcoords = _mm_shuffle_ps(texcoords, texcoords, _MM_SHUFFLE(1,0,3,2));
+            const __m128 gradient = _mm_div_ps(_mm_sub_ps(swapped_texcoords, texcoords), _mm_sub_ps(swapped, bounds));
+            texcoords = _mm_add_ps(texcoords, _mm_mul_ps(_mm_sub_ps(clipped, bounds), gradient));
+        }
+
+        // Convert to normalized device coordinates and write out the four corners as (x,y,s,t) followed by color
+        const __m128 ndc = _mm_add_ps(_mm_mul_ps(clipped, ndc_scale), ndc_offset);
+        _mm_storeu_ps(&out[0].position.x, _mm_shuffle_ps(ndc, texcoords, _MM_SHUFFLE(1,0,1,0)));
+        _mm_storeu_ps(&out[1].position.x, _mm_shuffle_ps(ndc, texcoords, _MM_SHUFFLE(1,2,1,2)));
+        _mm_storeu_ps(&out[2].position.x, _mm_shuffle_ps(ndc, texcoords, _MM_SHUFFLE(3,2,3,2)));
+        _mm_storeu_ps(&out[3].position.x, _mm_shuffle_ps(ndc, texcoords, _MM_SHUFFLE(3,0,3,0)));
+        for(int i=0; i<4; ++i) _mm_storeu_ps(&out[i].color.x, col);
+        out += 4;
+    }
+    return out;
+}
+#endif
+
+static draw_buffer_2d::vertex * emit_sprites_kernel(draw_buffer_2d::vertex * out, const float4 * quads, size_t count, const transform_2d & t, const rect & sr, const float2 & a, const float2 & b, const float4 & color)
+{
+#ifdef DRAW_2D_USE_SSE2
+    return emit_sprites_sse2(out, quads, count, t, sr, a, b, color);
+#else
+    return emit_sprites_scalar(out, quads, count, t, sr, a, b, color);
+#endif
+}
+
+void draw_buffer_2d::emit_sprites(const sprite_quad * quads, size_t count, const transform_2d & t, const float4 & color)
+{
+    if(t.scale <= 0)
+    {
+        // Mirroring transforms do not preserve the bounds ordering our kernels rely on, so fall back to the general path
+        transforms.push_back(t);
+        for(auto end = quads + count; quads != end; ++quads)
+        {
+            const float4 & r = quads->bounds, & tc = quads->texcoords;
+            draw_quad({r.xy(), tc.xy(), color}, {float2(r.z, r.y), float2(tc.z, tc.y), color}, {float2(r.z, r.w), float2(tc.z, tc.w), color}, {float2(r.x, r.w), float2(tc.x, tc.w), color});
+        }
+        transforms.pop_back();
+        return;
+    }
+
+    while(count)
+    {
+        // Emit as many sprites as will fit in the current batch. If not even one will fit, only start a new batch once a sprite survives
+        // clipping, so that batch boundaries depend solely on the geometry which is actually emitted.
+        size_t n = std::min(count, (batch_starts.back() + 0x10000 - vertices.size()) / 4), first = vertices.size();
+        if(n == 0)
+        {
+            vertex quad[4];
+            if(emit_sprites_kernel(quad, &quads->bounds, 1, t, scissor.back(), a, b, color) != quad)
+            {
+                begin_batch();
+                vertices.insert(end(vertices), std::begin(quad), std::end(quad));
+            }
+            n = 1;
+        }
+        else
+        {
+            vertices.resize(first + n*4);
+            vertices.resize(emit_sprites_kernel(vertices.data() + first, &quads->bounds, n, t, scissor.back(), a, b, color) - vertices.data());
+        }
+
+        auto & indices = begin_indices();
+        for(auto base = static_cast<uint16_t>(first - batch_starts.back()), end = static_cast<uint16_t>(vertices.size() - batch_starts.back()); base != end; base += 4)
+        {
+            const uint16_t quad_indices[] = {base, uint16_t(base+1), uint16_t(base+2), base, uint16_t(base+2), uint16_t(base+3)};
+            indices.insert(indices.end(), std::begin(quad_indices), std::end(quad_indices));
+        }
+        if(record_primitives) for(size_t v = first; v < vertices.size(); v += 4) primitive_starts.push_back(v);
+        quads += n;
+        count -= n;
     }
-    for(auto it = a, end = a + n; it != end; ++it) vertices.push_back({it->position * this->a + this->b, it->texcoord, it->color});
 }
 
 void draw_buffer_2d::draw_sprite(const rect & r, float s0, float t0, float s1, float t1, const float4 & color)
 {
-    draw_quad({float2(r.x0, r.y0), {s0,t0}, color},
-              {float2(r.x1, r.y0), {s1,t0}, color},
-              {float2(r.x1, r.y1), {s1,t1}, color},
-              {float2(r.x0, r.y1), {s0,t1}, color});
+    sprite_quad quad = {float4(static_cast<float>(r.x0), static_cast<float>(r.y0), static_cast<float>(r.x1), static_cast<float>(r.y1)), {s0, t0, s1, t1}};
+    if(quad.bounds.x > quad.bounds.z) { std::swap(quad.bounds.x, quad.bounds.z); std::swap(quad.texcoords.x, quad.texcoords.z); }
+    if(quad.bounds.y > quad.bounds.w) { std::swap(quad.bounds.y, quad.bounds.w); std::swap(quad.texcoords.y, quad.texcoords.w); }
+    emit_sprites(&quad, 1, transforms.back(), color);
+}
+
+float4 draw_buffer_2d::get_line_texcoords(int width)
+{
+    std::lock_guard<std::mutex> lock(library->mutex);
+    const auto & sprite = library->sheet.get_sprite(library->get_line_sprite(width));
+    sync_texture_dims();
+    return {sprite.s0, sprite.t0, sprite.s1, sprite.t1};
+}
+
+float4 draw_buffer_2d::get_corner_texcoords(int radius)
+{
+    std::lock_guard<std::mutex> lock(library->mutex);
+    const auto & sprite = library->sheet.get_sprite(library->get_corner_sprite(radius));
+    sync_texture_dims();
+    return {sprite.s0, sprite.t0, sprite.s1, sprite.t1};
 }
 
 void draw_buffer_2d::draw_line(const float2 & p0, const float2 & p1, int width, const float4 & color)
 {
-    int adjusted_width = std::min(std::max(static_cast<int>(std::round(transform_length(width))), 1), 8);
-    auto it = library->line_sprites.find(adjusted_width);
-    if(it == end(library->line_sprites)) return;
-    const auto & sprite = library->sheet.get_sprite(it->second);
+    const float4 sprite = get_line_texcoords(static_cast<int>(std::round(transform_length(width))));
     const float2 perp = normalize(cross(float3(p1-p0,0), float3(0,0,1)).xy()) * (width*0.5f + detransform_length(1));
-    draw_quad({p0+perp, {sprite.s0, (sprite.t0+sprite.t1)/2}, color},
-              {p0-perp, {sprite.s1, (sprite.t0+sprite.t1)/2}, color},
-              {p1-perp, {sprite.s1, (sprite.t0+sprite.t1)/2}, color},
-              {p1+perp, {sprite.s0, (sprite.t0+sprite.t1)/2}, color});
+    draw_quad({p0+perp, {sprite.x, (sprite.y+sprite.w)/2}, color},
+              {p0-perp, {sprite.z, (sprite.y+sprite.w)/2}, color},
+              {p1-perp, {sprite.z, (sprite.y+sprite.w)/2}, color},
+              {p1+perp, {sprite.x, (sprite.y+sprite.w)/2}, color});
 }
 
 void draw_buffer_2d::draw_bezier_curve(const float2 & p0, const float2 & p1, const float2 & p2, const float2 & p3, int width, const float4 & color)
 {
-    int adjusted_width = std::min(std::max(static_cast<int>(std::round(transform_length(width))), 1), 8);
-    auto it = library->line_sprites.find(adjusted_width);
-    if(it == end(library->line_sprites)) return;
-    const auto & sprite = library->sheet.get_sprite(it->second);
-    const float2 d01 = p1-p0, d12 = p2-p1, d23 = p3-p2;
+    const float4 sprite = get_line_texcoords(static_cast<int>(std::round(transform_length(width))));
+    const float2 q0 = transform_point(p0), q1 = transform_point(p1), q2 = transform_point(p2), q3 = transform_point(p3);
+    const float half_width = width*0.5f + detransform_length(1), margin = transform_length(half_width);
+
+    // The curve lies within the convex hull of its control points, so reject it early if that hull's bounds lie outside the scissor rect
+    const auto & sr = scissor.back();
+    const float2 lo = min(min(q0, q1), min(q2, q3)) - margin, hi = max(max(q0, q1), max(q2, q3)) + margin;
+    if(hi.x <= sr.x0 || hi.y <= sr.y0 || lo.x >= sr.x1 || lo.y >= sr.y1) return;
+    const bool unclipped = lo.x >= sr.x0 && lo.y >= sr.y0 && hi.x <= sr.x1 && hi.y <= sr.y1;
+
+    // Choose the number of segments via Wang's formula, so that the on-screen distance from the true curve is at most half a pixel
+    const float second_difference = std::max(length(q0 - q1*2.0f + q2), length(q1 - q2*2.0f + q3));
+    const int segments = std::min(std::max(static_cast<int>(std::ceil(std::sqrt(second_difference * 0.75f / 0.5f))), 1), 64);
+    if(unclipped) begin_primitive((segments+1)*2);
+
+    const float2 d01 = p1-p0, d12 = p2-p1, d23 = p3-p2, st0 = {sprite.x, (sprite.y+sprite.w)/2}, st1 = {sprite.z, (sprite.y+sprite.w)/2};
     float2 v0, v1;
-    for(float i=0; i<=32; ++i)
+    for(int i=0; i<=segments; ++i)
     {
-        float t = i/32, s = (1-t);
+        float t = static_cast<float>(i)/segments, s = (1-t);
         const float2 p = p0*(s*s*s) + p1*(3*s*s*t) + p2*(3*s*t*t) + p3*(t*t*t);
-        const float2 d = normalize(d01*(3*s*s) + d12*(6*s*t) + d23*(3*t*t)) * (width*0.5f + detransform_length(1));
+        const float2 d = normalize(d01*(3*s*s) + d12*(6*s*t) + d23*(3*t*t)) * half_width;
         const float2 v2 = {p.x-d.y, p.y+d.x}, v3 = {p.x+d.y, p.y-d.x};
-        if(i) draw_quad({v0, {sprite.s0, (sprite.t0+sprite.t1)/2}, color},
-                        {v1, {sprite.s1, (sprite.t0+sprite.t1)/2}, color},
-                        {v2, {sprite.s1, (sprite.t0+sprite.t1)/2}, color},
-                        {v3, {sprite.s0, (sprite.t0+sprite.t1)/2}, color});
+        if(unclipped)
+        {
+            // The whole curve is visible, so emit it as a strip of quads in which consecutive quads share an edge
+            const auto base = static_cast<uint16_t>(vertices.size() - batch_starts.back());
+            if(i)
+            {
+                auto & indices = begin_indices();
+                const uint16_t quad_indices[] = {uint16_t(base-2), uint16_t(base-1), uint16_t(base+1), uint16_t(base-2), uint16_t(base+1), base};
+                indices.insert(indices.end(), std::begin(quad_indices), std::end(quad_indices));
+            }
+            vertices.push_back({transform_point(v3) * a + b, st0, color});
+            vertices.push_back({transform_point(v2) * a + b, st1, color});
+        }
+        else if(i) draw_quad({v0, st0, color}, {v1, st1, color}, {v2, st1, color}, {v3, st0, color});
         v0 = v3;
         v1 = v2;
     }
@@ -426,9 +1749,7 @@ void draw_buffer_2d::draw_bezier_curve(const float2 & p0, const float2 & p1, con
 
 void draw_buffer_2d::draw_rect(const rect & r, const float4 & color)
 {
-    const auto & sprite = library->sheet.get_sprite(0);
-    float s = (sprite.s0+sprite.s1)/2, t = (sprite.t0+sprite.t1)/2;
-    draw_sprite({r.x0, r.y0, r.x1, r.y1}, s, t, s, t, color);
+    draw_sprite({r.x0, r.y0, r.x1, r.y1}, white_texcoord.x, white_texcoord.y, white_texcoord.x, white_texcoord.y, color);
 }
 
 static rect take_x0(rect & r, int x) { rect r2 = {r.x0, r.y0, r.x0+x, r.y1}; r.x0 = r2.x1; return r2; }
@@ -437,24 +1758,21 @@ static rect take_y0(rect & r, int y) { rect r2 = {r.x0, r.y0, r.x1, r.y0+y}; r.y
 static rect take_y1(rect & r, int y) { rect r2 = {r.x0, r.y1-y, r.x1, r.y1}; r.y1 = r2.y0; return r2; }
 void draw_buffer_2d::draw_partial_rounded_rect(rect r, int radius, const float4 & color, bool tl, bool tr, bool bl, bool br)
 {
-    int adjusted_radius = std::min(std::max(static_cast<int>(std::ceilf(radius * transforms.back().scale)), 1), 32);
-    auto it = library->corner_sprites.find(adjusted_radius);
-    if(it == end(library->corner_sprites)) return;
-    auto & sprite = library->sheet.get_sprite(it->second);
-    
+    const float4 sprite = get_corner_texcoords(static_cast<int>(std::ceilf(radius * transforms.back().scale)));
+
     if(tl || tr)
     {
         rect r2 = take_y0(r, radius);
-        if(tl) draw_sprite(take_x0(r2, radius), sprite.s1, sprite.t1, sprite.s0, sprite.t0, color);    
-        if(tr) draw_sprite(take_x1(r2, radius), sprite.s0, sprite.t1, sprite.s1, sprite.t0, color);
+        if(tl) draw_sprite(take_x0(r2, radius), sprite.z, sprite.w, sprite.x, sprite.y, color);    
+        if(tr) draw_sprite(take_x1(r2, radius), sprite.x, sprite.w, sprite.z, sprite.y, color);
         draw_rect(r2, color);
     }
 
     if(bl || br)
     {
         rect r2 = take_y1(r, radius);
-        if(bl) draw_sprite(take_x0(r2, radius), sprite.s1, sprite.t0, sprite.s0, sprite.t1, color);
-        if(br) draw_sprite(take_x1(r2, radius), sprite.s0, sprite.t0, sprite.s1, sprite.t1, color);
+        if(bl) draw_sprite(take_x0(r2, radius), sprite.z, sprite.y, sprite.x, sprite.w, color);
+        if(br) draw_sprite(take_x1(r2, radius), sprite.x, sprite.y, sprite.z, sprite.w, color);
         draw_rect(r2, color);
     }
 
@@ -471,22 +1789,73 @@ void draw_buffer_2d::draw_circle(const int2 & center, int radius, const float4 &
     draw_rounded_rect({center.x-radius, center.y-radius, center.x+radius, center.y+radius}, radius, color);
 }
 
-void draw_buffer_2d::draw_text(int2 p, utf8::string_view text, const float4 & color)
+const std::vector<draw_buffer_2d::sprite_quad> & draw_buffer_2d::layout_text(utf8::string_view text)
 {
-    for(auto codepoint : text)
+    // Look up the run by a 64-bit FNV-1a hash of the font and text, confirming the match so that hash collisions simply replace the entry
+    std::lock_guard<std::mutex> lock(library->mutex);
+    const font * f = &library->default_font;
+    uint64_t key = 14695981039346656037ULL ^ reinterpret_cast<uintptr_t>(f);
+    for(auto it = text.first; it != text.last; ++it) key = (key ^ static_cast<uint8_t>(*it)) * 1099511628211ULL;
+    auto & run = text_runs[key];
+    run.last_frame = frame_index;
+    if(run.f == f && run.generation == library->sheet.get_texture_generation() && run.text.size() == static_cast<size_t>(text.last - text.first) && std::equal(text.first, text.last, run.text.begin()))
     {
-        if(auto * g = library->default_font.get_glyph(codepoint))
+        f->touch_glyphs(run.glyphs.data(), run.glyphs.size());
+        return run.quads;
+    }
+
+    // Lay out the run from scratch, relative to an origin of (0,0). Rasterizing a glyph may grow the sprite sheet, changing the texcoords of
+    // the glyphs before it, in which case we simply lay out the run again, as all of its glyphs will then be resident.
+    run.f = f;
+    run.text.assign(text.first, text.last);
+    do
+    {
+        run.generation = library->sheet.get_texture_generation();
+        run.quads.clear();
+        run.glyphs.clear();
+        int2 p = {0,0};
+        uint32_t codes[64];
+        for(auto units = text.first; units != text.last; )
         {
-            auto & s = library->sheet.get_sprite(g->sprite_index);
-            const int2 p0 = p + g->offset, p1 = p0 + s.dims;
-            draw_sprite({p0.x, p0.y, p1.x, p1.y}, s.s0, s.t0, s.s1, s.t1, color);
-            p.x += g->advance;
+            const size_t count = utf8::decode(units, text.last, codes, 64);
+            for(size_t i=0; i<count; ++i)
+            {
+                if(auto * g = f->get_glyph(codes[i]))
+                {
+                    auto & s = library->sheet.get_sprite(g->sprite_index);
+                    const int2 p0 = p + g->offset, p1 = p0 + g->dims;
+                    run.quads.push_back({float4(static_cast<float>(p0.x), static_cast<float>(p0.y), static_cast<float>(p1.x), static_cast<float>(p1.y)), {s.s0, s.t0, s.s1, s.t1}});
+                    run.glyphs.push_back(g);
+                    p.x += g->advance;
+                }
+            }
         }
-    }
+    } while(run.generation != library->sheet.get_texture_generation());
+    sync_texture_dims();
+    return run.quads;
 }
 
-void draw_buffer_2d::draw_shadowed_text(int2 p, utf8::string_view text, const float4 & color)
+void draw_buffer_2d::sync_texture_dims()
 {
-    draw_text(p+1, text, {0,0,0,color.w});
-    draw_text(p, text, color);
+    const auto & white = library->sheet.get_sprite(0);
+    white_texcoord = {(white.s0+white.s1)/2, (white.t0+white.t1)/2};
+    const int2 & dims = library->sheet.get_texture_dims();
+    if(dims.x == texture_dims.x && dims.y == texture_dims.y) return;
+    const float2 scale = float2(texture_dims) / float2(dims);
+    for(auto & v : vertices) v.texcoord = v.texcoord * scale;
+    texture_dims = dims;
 }
+
+void draw_buffer_2d::draw_text(int2 p, utf8::string_view text, const float4 & color)
+{
+    const auto & quads = layout_text(text);
+    emit_sprites(quads.data(), quads.size(), transforms.back() * transform_2d::translation(float2(p)), color);
+}
+
+void draw_buffer_2d::draw_shadowed_text(int2 p, utf8::string_view text, const float4 & color)
+{
+    // Both passes share the same cached layout, differing only in translation and color
+    const auto & quads = layout_text(text);
+    emit_sprites(quads.data(), quads.size(), transforms.back() * transform_2d::translation(float2(p+1)), {0,0,0,color.w});
+    emit_sprites(quads.data(), quads.size(), transforms.back() * transform_2d::translation(float2(p)), color);
+}
\ No newline at end of file
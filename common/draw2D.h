@@ -15,27 +15,101 @@
 #include <vector>   // For std::vector<T>
 #include <array>    // For std::array<T,N>
 #include <map>      // For std::map<K,V>
+#include <unordered_map> // For std::unordered_map<K,V>
+#include <string>   // For std::string
+#include <mutex>    // For std::mutex
+#include <iosfwd>   // For std::istream, std::ostream
+
+// The font used by sprite_library unless another is given, which may be overridden at build time
+#ifndef DRAW_2D_DEFAULT_FONT
+#ifdef _WIN32
+#define DRAW_2D_DEFAULT_FONT "c:/windows/fonts/arialbd.ttf"
+#else
+#define DRAW_2D_DEFAULT_FONT "/usr/share/fonts/truetype/dejavu/DejaVuSans-Bold.ttf"
+#endif
+#endif
 
 struct sprite
 {
     std::shared_ptr<const uint8_t> pixels; int2 dims; bool border; // The bitmap of per-pixel alpha values
-    float s0, t0, s1, t1;                                          // The subrect of this sprite within the texture atlas
+    bool distance_field;                                           // If set, pixels hold a signed distance field, 128 on the edge and increasing inwards
+    int page;                                                      // The layer of the texture array which holds this sprite
+    float s0, t0, s1, t1;                                          // The subrect of this sprite within its page, with s negated for distance fields, and the page added to t
 };
 
+// Sprites are packed into the texture atlas incrementally, using a skyline packer, so that existing sprites never move. When a sprite does not fit,
+// the atlas doubles in size, which changes the texcoords of existing sprites, and so increments the texture generation. Once it reaches its max dims,
+// further pages of the same size are added instead, which are intended to be the layers of a texture array. Sprites may also be erased, and the space
+// they occupied is reused by later sprites. Sprites placed as evictable are kept in least recently used order, and when one does not fit, a batch of
+// those not used since the last call to begin_frame() is evicted, which changes the texture generation at most once per frame.
 class sprite_sheet
 {
+    struct skyline_segment { int x, y, width; };
+    struct page
+    {
+        std::vector<skyline_segment> skyline;   // Lowest free row of the page across its width, as segments ordered from left to right
+        std::vector<rect> free_rects;           // Regions of the page below the skyline which were freed by erasing sprites
+    };
     std::vector<sprite> sprites;
-    std::vector<uint8_t> tex_pixels;
-    int2 tex_dims;
+    std::vector<int2> positions;            // Location of the bitmap of each sprite within its page, once packed
+    struct cache_entry { size_t prev, next, last_used, * owner; }; // Links in the list of evictable sprites, and where to write npos on eviction
+    std::vector<cache_entry> cache_entries; // One per sprite, with a null owner for sprites which are not evictable
+    size_t lru_first, lru_last;             // Most and least recently used evictable sprites
+    size_t frame, frame_generation;         // The current frame, and the texture generation when it began
+    bool reclaimable;                       // True if sprites have been erased since free space was last reclaimed
+    std::vector<size_t> pending;            // Sprites inserted since the last call to prepare_texture()
+    std::vector<size_t> free_indices;       // Indices of erased sprites, which will be reused by subsequent insertions
+    std::vector<uint8_t> tex_pixels;        // The pixels of every page, one after another
+    int2 tex_dims, max_dims;
+    int max_pages;
+    std::vector<page> pages;
+    rect dirty;                             // Region of the pages modified since the last call to clear_dirty_rect()
+    int2 dirty_pages;                       // Range of pages to which the dirty region applies
+    size_t generation;
+
+    size_t allocate_index(sprite s);
+    void release_sprite(size_t index);
+    bool evict_sprites(const int2 & dims);
+    void link_sprite(size_t index);
+    void unlink_sprite(size_t index);
+    bool pack_sprite(size_t index);
+    bool pack_sprite(size_t index, int page);
+    bool fits_in_page(const int2 & dims) const;
+    void reclaim_free_space();
+    void grow_texture();
+    void update_texcoords(size_t index);
+    void mark_dirty(const rect & r, int page);
 public:
+    static const size_t npos = static_cast<size_t>(-1);
+
     sprite_sheet();
 
     const sprite & get_sprite(size_t index) const { return sprites[index]; }
-    const void * get_texture_data() const { return tex_pixels.data(); }
-    const int2 & get_texture_dims() const { return tex_dims; }
+    bool is_placed(size_t index) const { return positions[index].x >= 0; } // False for sprites not yet placed by prepare_texture(), and for erased indices
+    const void * get_texture_data() const { return tex_pixels.data(); } // Every page, one after another
+    const int2 & get_texture_dims() const { return tex_dims; } // The dims of a single page
+    int get_page_count() const { return static_cast<int>(pages.size()); }
+    const rect & get_dirty_rect() const { return dirty; } // Empty if the texture has not changed since the last call to clear_dirty_rect()
+    const int2 & get_dirty_pages() const { return dirty_pages; } // The first and one past the last page modified within the dirty rect
+    size_t get_texture_generation() const { return generation; } // Changes whenever the texcoords or contents of existing sprites change
 
     size_t insert_sprite(sprite s);
-    void prepare_texture();
+    void prepare_texture(); // Places all sprites inserted since the last call into the texture, growing it or adding pages as necessary
+    size_t cache_sprite(sprite s); // Inserts and immediately places a sprite, without growing the texture past the max dims or adding pages, returns npos if there is no room, and throws if the sprite is too large for any page
+    size_t cache_sprite(sprite s, size_t * owner); // Places an evictable sprite, evicting others or as a last resort adding a page, and stores its index in *owner, which is set to npos if it is evicted
+    void track_sprite(size_t index, size_t * owner); // Makes a placed sprite evictable, as if it had been placed by cache_sprite(s, owner)
+    void touch_sprite(size_t index) { if(cache_entries[index].owner && cache_entries[index].last_used != frame) { unlink_sprite(index); link_sprite(index); } } // Marks an evictable sprite as used during the current frame
+    void begin_frame() { ++frame; frame_generation = generation; } // Sprites touched or placed since the last call are never evicted, as geometry being recorded may refer to them
+    void erase_sprite(size_t index);
+    const int2 & get_max_texture_dims() const { return max_dims; }
+    void set_max_texture_dims(const int2 & dims) { max_dims = dims; } // Should not exceed GL_MAX_TEXTURE_SIZE
+    int get_max_page_count() const { return max_pages; }
+    void set_max_page_count(int count) { max_pages = count; } // Once reached, prepare_texture() throws rather than adding a page, and cache_sprite() returns npos
+    void clear_dirty_rect() { dirty = {0,0,0,0}; dirty_pages = {0,0}; }
+
+    size_t get_sprite_count() const { return sprites.size(); }
+    void save(std::ostream & out) const; // Writes the texture and the placement of every sprite, all of which must have been placed
+    bool load(std::istream & in); // Restores the texture and sprite placements, but not the sprite bitmaps, returning false if the data is invalid
 };
 
 sprite make_circle_quadrant(int radius);
@@ -47,12 +121,13 @@ namespace utf8
     uint32_t code(const char * units); // Assumes units points to the start of a valid utf-8 sequence of code units
     std::array<char,5> units(uint32_t code); // Assumes code < 0x110000
     bool is_valid(const char * units, size_t count); // Return true if the given sequence of code units is valid utf-8
+    size_t decode(const char *& units, const char * end, uint32_t * codes, size_t max_codes); // Decodes up to max_codes codepoints from a valid utf-8 sequence, advancing units past them, and returns the number decoded
 
     struct codepoint_iterator 
     { 
         const char * p;
-        uint32_t operator * () const { return code(p); }
-        codepoint_iterator & operator ++ () { p = next(p); return *this; }
+        uint32_t operator * () const { return static_cast<uint8_t>(*p) < 0x80 ? static_cast<uint32_t>(*p) : code(p); }
+        codepoint_iterator & operator ++ () { p = static_cast<uint8_t>(*p) < 0x80 ? p + 1 : next(p); return *this; }
         bool operator != (const codepoint_iterator & r) const { return p != r.p; }
     };
 
@@ -66,38 +141,101 @@ namespace utf8
     };
 }
 
+// The contents of a font file, which stay resident for as long as any face loaded from them, so that glyphs can be rasterized on demand. Files opened
+// by path are memory-mapped, and opening the same path again while the file is still in use shares the existing mapping.
+class font_file
+{
+    const uint8_t * data;
+    size_t size;
+    uint64_t hash;
+    std::shared_ptr<const void> storage; // Unmaps the file when the last reference is released
+    font_file(const uint8_t * data, size_t size, std::shared_ptr<const void> storage);
+public:
+    font_file(const void * data, size_t size); // Refers to font data which must outlive the font_file, such as an embedded array, without copying it
+
+    static std::shared_ptr<const font_file> open(const std::string & path);
+
+    const uint8_t * get_data() const { return data; }
+    size_t get_size() const { return size; }
+    uint64_t get_hash() const { return hash; } // Hash of the contents, computed once when the file is opened
+};
+
 struct glyph_data
 {
     size_t sprite_index;
-    int2 offset;
+    int2 offset, dims; // Placement of the glyph's quad relative to the pen position, which may have a higher resolution sprite
     int advance;
 };
 
+// Glyphs are rasterized into the sprite sheet the first time they are drawn, as evictable sprites. If the sheet cannot grow any further, the least
+// recently used glyphs are evicted to make room, except for those used since the last call to sprite_sheet::begin_frame().
 class font
 {
+    struct face; // A loaded font file, along with the codepoints it provides
+    struct glyph_entry : glyph_data { int face_index; }; // face_index is -1 if no face provides the codepoint, -2 if not yet looked up
+    struct glyph_page { glyph_entry entries[256]; glyph_page(); }; // Glyphs for a run of 256 consecutive codepoints, allocated on first lookup
     sprite_sheet * sprites;
-    std::map<int, glyph_data> glyphs;
+    std::vector<std::shared_ptr<const face>> faces;
+    mutable std::vector<std::unique_ptr<glyph_page>> pages; // Indexed by codepoint / 256. Metrics are cached for every codepoint looked up, but sprites only for those drawn
+
+    glyph_entry * find_glyph(int codepoint) const;
 public:
     font() : sprites() {}
     font(sprite_sheet * sprites) : sprites(sprites) {}
 
     int line_height, baseline;
 
-    const glyph_data * get_glyph(int codepoint) const;
+    const glyph_data * get_glyph(int codepoint) const; // Rasterizes the glyph on first use, may grow the sprite sheet
+    void preload_glyphs(std::vector<int> codepoints) const; // Rasterizes any of the given glyphs which are not yet resident, in parallel, to avoid a stall on first use
+    const glyph_data * get_glyph_metrics(int codepoint) const; // Looks up the glyph without rasterizing it, so its sprite_index may be npos
     int get_text_width(utf8::string_view text) const;
     std::string::size_type get_cursor_pos(utf8::string_view text, int x) const;
 
-    void load_glyphs(const std::string & path, int size, const std::vector<int> & codepoints);
+    void touch_glyphs(const glyph_data * const * glyphs, size_t count) const; // Marks glyphs returned by get_glyph() as used in the current frame
+    void load_glyphs(std::shared_ptr<const font_file> file, int size, const std::vector<int> & codepoints, bool distance_field = false); // Later calls take precedence over earlier ones
+    void load_glyphs(std::shared_ptr<const font_file> file, int size, bool distance_field = false); // Provides every codepoint present in the font
+    void load_glyphs(const std::string & path, int size, const std::vector<int> & codepoints, bool distance_field = false) { load_glyphs(font_file::open(path), size, codepoints, distance_field); }
+    void load_glyphs(const std::string & path, int size, bool distance_field = false) { load_glyphs(font_file::open(path), size, distance_field); }
+
+    uint64_t get_cache_key() const; // Identifies the loaded fonts and their parameters, so that saved glyphs are only reused with the same fonts
+    void save(std::ostream & out) const; // Writes the metrics and sprite indices of every glyph looked up so far
+    bool load(std::istream & in, sprite_sheet & sheet, std::vector<bool> & unclaimed); // Restores glyphs written by save(), whose sprites must be marked in unclaimed, and are then cleared and tracked by the sheet being restored
+};
+
+// Measures a string in a single pass, recording the pen position at every codepoint boundary, so that carets and selections can be placed, and
+// clicks mapped back to positions in the string, by binary search. Storage is reused between calls to measure(), so remeasuring does not allocate
+// unless the string has grown.
+class text_metrics
+{
+    struct boundary { std::string::size_type offset; int x; };
+    std::vector<boundary> boundaries; // One before each codepoint which the font provides, plus one for the end of the string
+public:
+    void measure(const font & f, utf8::string_view text);
+
+    int get_width() const { return boundaries.empty() ? 0 : boundaries.back().x; }
+    int get_x(std::string::size_type offset) const; // Pen position at the given byte offset, rounded up to the next codepoint boundary
+    std::string::size_type get_offset(int x) const; // Byte offset of the codepoint boundary nearest to the given pen position
 };
 
+// Sprites for rounded corners and lines are generated the first time each radius or width is drawn, and are evicted like glyphs once unused
 struct sprite_library
 {
-    sprite_sheet sheet;
+    mutable sprite_sheet sheet; // Glyphs, corners and lines are rasterized into the sheet on demand, by otherwise const lookups
     font default_font;
-    std::map<int, size_t> corner_sprites;
-    std::map<int, size_t> line_sprites;
+    mutable std::map<int, size_t> corner_sprites; // Indices of the circle quadrant sprites generated so far, by radius, or npos once evicted
+    mutable std::map<int, size_t> line_sprites; // Indices of the line cross-section sprites generated so far, by width, or npos once evicted
+    mutable std::mutex mutex; // Held by draw buffers whenever they look up or generate sprites, so that sub-buffers can be recorded concurrently
 
-    sprite_library();
+    sprite_library(const std::string & font_path = DRAW_2D_DEFAULT_FONT); // The default font provides codepoints 32 to 255 at 14 pixels
+
+    size_t get_corner_sprite(int radius) const; // Generates the sprite if it is not resident, so may grow the sprite sheet or evict other sprites
+    size_t get_line_sprite(int width) const; // Generates the sprite if it is not resident, so may grow the sprite sheet or evict other sprites
+
+    // The sprite sheet and glyphs can be saved to a cache file when an application exits, and restored on the next launch, after loading
+    // the same fonts, so that glyphs drawn in the previous session need not be rasterized again
+    uint64_t get_cache_key() const;
+    bool load_cache(const std::string & path); // Returns false, leaving the library unchanged, if the file is missing or was saved with different fonts
+    void save_cache(const std::string & path) const;
 };
 
 struct transform_2d 
@@ -115,23 +253,51 @@ struct transform_2d
 };
 
 // The purpose of this class is to support a handful of basic 2D drawing operations (rectangles, circles, rounded rectangles, lines, bezier curves, and text)
-// The resultant geometry is coalesced into a single vertex/index buffer which can be rendered via a single draw call.
+// The resultant geometry is coalesced into a single vertex buffer and a small number of batches of 16-bit indices, one draw call per batch.
+// A new batch is started whenever the current one would need to address more than 65,536 vertices, so large frames never overflow, and
+// each overlay level contributes its own batches, which must be drawn in order.
+// Independent parts of a frame may be recorded concurrently into sub-buffers, begun from the parent buffer on one thread and then recorded on another.
+// Appending the finished sub-buffers to the parent, in the order they would otherwise have been drawn, yields exactly the same output. Drawing text,
+// or a corner radius or line width, for the first time rasterizes it into the shared sprite library, so every buffer holds the library's mutex while
+// it looks up glyphs and sprites. Anything else which uses the library's font or sheet while sub-buffers are recording, such as measuring text on
+// another thread, must hold the mutex too.
+// If the sprite sheet grows during a frame, texcoords emitted so far are rescaled to match.
+// Optionally, each frame is compared against the previous one tile by tile, so that a renderer which keeps the previous image can redraw only what changed.
+// Sprites holding distance fields, such as glyphs loaded with distance_field set, are emitted with negative s texcoords. Renderers should sample at the
+// absolute texcoord, and threshold the result at 0.5 where s is negative, which keeps such text crisp at any scale. The integer part of t is the page of
+// the sprite sheet, which renderers should use as the layer of a texture array, sampling at the fractional part. Packed s is in [0,2), with 1 added to
+// the absolute s of distance field sprites, so a renderer of packed vertices should double the normalized s and subtract 1 if s >= 1. Packed t is in
+// [0,8), so a renderer should multiply the normalized t by 8, and at most max_packed_pages pages may be used with packed vertices, which
+// end_frame() enforces by throwing. Renderers of packed vertices should limit the sheet with set_max_page_count(draw_buffer_2d::max_packed_pages).
 class draw_buffer_2d
 {
 public:
     struct vertex { float2 position, texcoord; float4 color; };
+    struct packed_vertex { linalg::vec<short,2> position; linalg::vec<uint16_t,2> texcoord; linalg::vec<uint8_t,4> color; }; // Position is in quarter pixels, texcoord spans [0,2) by [0,8), see below
+    struct batch { size_t first_vertex, vertex_count; const uint16_t * indices; size_t index_count; }; // Indices are relative to first_vertex
+    static const int max_packed_pages = 8; // Number of sprite sheet pages addressable by packed texcoords
 
     const sprite_library & get_library() const { return *library; }
     const std::vector<vertex> & get_vertices() const { return vertices; }
-    const std::vector<uint16_t> & get_indices() const { return out_indices; }
+    const std::vector<packed_vertex> & get_packed_vertices() const { return packed_vertices; } // Only filled by end_frame() if packing is enabled
+    const std::vector<batch> & get_batches() const { return batches; }
+    float2 get_packed_position_scale() const { return a * 0.25f; } // Packed positions map to normalized device coordinates as position * scale + offset
+    float2 get_packed_position_offset() const { return b; }
     const rect & get_scissor_rect() const { return scissor.back(); }
+    uint64_t get_frame_hash() const { return frame_hash; } // Hash of the vertices and batches produced by the last call to end_frame(), and of the texture generation
+    bool is_frame_changed() const { return frame_changed; } // False if end_frame() produced exactly the same output as the frame before it
+    const std::vector<rect> & get_damage_rects() const { return damage; } // Regions of the window which differ from the previous frame, or the whole window if damage tracking is disabled
 
     const float transform_length(float length) const { return length * transforms.back().scale; }
     const float detransform_length(float length) const { return length / transforms.back().scale; }
     const float2 transform_point(const float2 & point) const { return transforms.back().transform_point(point); }
     const float2 detransform_point(const float2 & point) const { return transforms.back().detransform_point(point); }
 
+    void set_vertex_packing(bool enable) { pack_vertices = enable; } // If enabled, end_frame() also produces 12-byte packed vertices
+    void set_damage_tracking(bool enable) { track_damage = enable; tile_hashes.clear(); } // If enabled, end_frame() compares each tile of the window against the previous frame
     void begin_frame(const sprite_library & library, const int2 & window_size);
+    void begin_frame(const draw_buffer_2d & parent); // Begins a sub-buffer, inheriting the parent's current scissor rect, transform, and overlay level
+    void append(const draw_buffer_2d & sub); // Appends the contents of a sub-buffer as if they had been drawn directly into this buffer
     void end_frame();
     void begin_overlay();
     void end_overlay();
@@ -153,16 +319,50 @@ public:
     void draw_text(int2 p, utf8::string_view text, const float4 & color);
     void draw_shadowed_text(int2 p, utf8::string_view text, const float4 & color);
 private:
-    
-
-    struct list { size_t level,first,last; };
+    struct sprite_quad { float4 bounds, texcoords; }; // Bounds are x0,y0,x1,y1 and texcoords are s0,t0,s1,t1, prior to transformation
+
+    void reset();
+    void begin_batch();
+    void begin_primitive(size_t n); // Starts a new batch if the next n vertices will not fit in the current one
+    void compute_damage();
+    void sync_texture_dims(); // Rescales texcoords emitted so far if the sprite sheet has grown since they were emitted, the library's mutex must be held
+    float4 get_line_texcoords(int width); // Texcoords of the line sprite of the given on-screen width, as s0,t0,s1,t1
+    float4 get_corner_texcoords(int radius); // Texcoords of the corner sprite of the given on-screen radius, as s0,t0,s1,t1
+    std::vector<uint16_t> & begin_indices(); // Returns the index storage for the current overlay level, segmented by batch
+    void emit_polygon(const vertex * polygon, size_t n); // Polygon is specified in window coordinates, and must already be clipped
+    void emit_sprites(const sprite_quad * quads, size_t count, const transform_2d & t, const float4 & color); // Transforms, clips, and emits many sprites at once
+    const std::vector<sprite_quad> & layout_text(utf8::string_view text); // Returns glyph quads relative to the text origin, cached across frames
+
+    struct segment { size_t base_vertex, first; }; // A run of indices within a single level which refer to the same batch of vertices
+    struct level { std::vector<uint16_t> indices; std::vector<segment> segments; };
+    struct text_run { const font * f; std::string text; std::vector<sprite_quad> quads; std::vector<const glyph_data *> glyphs; size_t generation, last_frame; };
     const sprite_library * library;
+    std::unordered_map<uint64_t, text_run> text_runs; // Keyed by a hash of the font and the text content, evicted when not drawn for a frame
+    size_t frame_index = 0;
     std::vector<vertex> vertices;
-    std::vector<uint16_t> indices, out_indices;
-    std::vector<list> lists;
+    std::vector<packed_vertex> packed_vertices;
+    bool pack_vertices = false;
+    std::vector<level> levels; // Geometry for each overlay level is recorded separately, and retained between frames to avoid reallocation
+    size_t current_level;
+    std::vector<size_t> batch_starts;
+    std::vector<size_t> primitive_starts; // Only recorded by sub-buffers, so that append() can replay batch boundaries
+    bool record_primitives = false;
+    std::vector<batch> batches;
+    uint64_t frame_hash = 0;
+    size_t sheet_generation = 0; // Texture generation of the sprite sheet at the last call to end_frame(), as the texture can change under identical geometry
+    bool frame_changed = true;
+    static const int damage_tile_size = 32;
+    bool track_damage = false;
+    int2 damage_window_size;
+    struct damage_vertex { float2 tile; uint64_t hash; }; // Position in units of tiles, and a hash of the vertex contents
+    std::vector<damage_vertex> damage_vertices;
+    std::vector<uint64_t> tile_hashes, previous_tile_hashes; // Tiles are hashed from the triangles overlapping them, in draw order
+    std::vector<rect> damage;
     std::vector<rect> scissor;
     std::vector<transform_2d> transforms;
     float2 a, b;
+    int2 texture_dims; // Dimensions of the sprite sheet which texcoords emitted so far refer to
+    float2 white_texcoord; // Center of the solid white sprite, relative to texture_dims, so that rects can be drawn without taking the mutex
 };
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -173,16 +373,40 @@ private:
 #include <gl/GL.h>
 GLuint make_sprite_texture_opengl(const sprite_sheet & sprites)
 {
+    // Without texture arrays, the pages of the sprite sheet are stacked vertically in a single texture
     GLuint tex;
     glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, sprites.get_texture_dims().x, sprites.get_texture_dims().y, 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, sprites.get_texture_dims().x, sprites.get_texture_dims().y * sprites.get_page_count(), 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glBindTexture(GL_TEXTURE_2D, 0);
     return tex;
 }
 
+void update_sprite_texture_opengl(sprite_sheet & sprites, GLuint tex)
+{
+    // Upload only the region of each page which changed, unless the atlas grew or gained a page, in which case the whole atlas must be uploaded again
+    const rect & r = sprites.get_dirty_rect();
+    if(r.x0 >= r.x1 || r.y0 >= r.y1) return;
+    const int2 & dims = sprites.get_texture_dims();
+    const int2 & pages = sprites.get_dirty_pages();
+    glBindTexture(GL_TEXTURE_2D, tex);
+    if(r.width() == dims.x && r.height() == dims.y) glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, dims.x, dims.y * sprites.get_page_count(), 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
+    else
+    {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, dims.x);
+        for(int page=pages.x; page<pages.y; ++page)
+        {
+            const int y0 = page*dims.y + r.y0;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, r.x0, y0, r.width(), r.height(), GL_ALPHA, GL_UNSIGNED_BYTE, reinterpret_cast<const uint8_t *>(sprites.get_texture_data()) + y0*dims.x + r.x0);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    sprites.clear_dirty_rect();
+}
+
 void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_texture)
 {
     glPushAttrib(GL_ALL_ATTRIB_BITS);
@@ -190,12 +414,22 @@ void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_text
     glBindTexture(GL_TEXTURE_2D, sprite_texture);
     glEnable(GL_BLEND); 
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glMatrixMode(GL_TEXTURE);
+    glPushMatrix();
+    glLoadIdentity();
+    glScalef(1, 1.0f / buffer.get_library().sheet.get_page_count(), 1); // Map page + t onto the stacked pages
     for(GLenum array : {GL_VERTEX_ARRAY, GL_TEXTURE_COORD_ARRAY, GL_COLOR_ARRAY}) glEnableClientState(array);
-    glVertexPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->position);
-    glTexCoordPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->texcoord);
-    glColorPointer(4, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->color);
-    glDrawElements(GL_TRIANGLES, buffer.get_indices().size(), GL_UNSIGNED_SHORT, buffer.get_indices().data());
+    for(auto & batch : buffer.get_batches())
+    {
+        const auto * vertices = buffer.get_vertices().data() + batch.first_vertex;
+        glVertexPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->position);
+        glTexCoordPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->texcoord);
+        glColorPointer(4, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->color);
+        glDrawElements(GL_TRIANGLES, batch.index_count, GL_UNSIGNED_SHORT, batch.indices);
+    }
     for(GLenum array : {GL_VERTEX_ARRAY, GL_TEXTURE_COORD_ARRAY, GL_COLOR_ARRAY}) glDisableClientState(array);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
     glPopAttrib();
 }
 #endif
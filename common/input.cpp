@@ -3,11 +3,94 @@
 
 #include "input.h"
 
+input_queue::input_queue(size_t capacity) : head(0), tail(0), overflow_count(0), waiting(false)
+{
+    size_t size = 1;
+    while(size < capacity) size *= 2;
+    slots.reset(new slot[size]);
+    for(size_t i=0; i<size; ++i) slots[i].state = slot_free;
+    mask = size - 1;
+}
+
+void input_queue::push(const input_event & e)
+{
+    const size_t t = tail;
+    if(t != head && (e.type == input::cursor_motion || e.type == input::scroll))
+    {
+        // Fold motion and scrolling into the newest event if it is of the same kind, so that a fast mouse cannot fill the queue on its own.
+        // The slot is claimed first, so that the consumer cannot take it while it is being modified, and if the consumer got there first,
+        // the event is simply queued on its own.
+        slot & back = slots[(t - 1) & mask];
+        int ready = slot_ready;
+        if(back.state.compare_exchange_strong(ready, slot_merging))
+        {
+            const bool merged = back.event.type == e.type && back.event.mods == e.mods;
+            if(merged)
+            {
+                back.event.cursor = e.cursor;
+                back.event.delta += e.delta;
+                back.event.time = e.time;
+            }
+            back.state = slot_ready;
+            if(merged) return;
+        }
+    }
+    if(t - head > mask)
+    {
+        ++overflow_count;
+        return;
+    }
+    slot & s = slots[t & mask];
+    s.event = e;
+    s.state = slot_ready;
+    tail = t + 1;
+
+    // Only take the mutex if the consumer is asleep, which it can only be while the queue is empty
+    if(waiting)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cv.notify_one();
+    }
+}
+
+bool input_queue::pop(input_event & e)
+{
+    const size_t h = head;
+    if(h == tail) return false;
+    slot & s = slots[h & mask];
+    int ready = slot_ready;
+    if(!s.state.compare_exchange_strong(ready, slot_reading)) return false; // The producer is merging into this event, so it is not ready yet
+    e = s.event;
+    s.state = slot_free;
+    head = h + 1;
+    return true;
+}
+
+void input_queue::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    waiting = true;
+    cv.wait(lock, [this]() { return !empty(); });
+    waiting = false;
+}
+
 struct input_buffer
 {
-    std::vector<input_event> & events;
+    input_queue queue;
     float2 cursor;
     int entered, mods;
+    std::atomic<int> width, height, framebuffer_width, framebuffer_height;
+
+    input_buffer(size_t capacity, const float2 & cursor, const int2 & size, const int2 & framebuffer_size) : queue(capacity), cursor(cursor), entered(), mods(),
+        width(size.x), height(size.y), framebuffer_width(framebuffer_size.x), framebuffer_height(framebuffer_size.y) {}
+
+    // Each event is stamped with the time at which it was received, which does not depend on how long the consumer takes to get to it
+    input_event make_event(input type, int mods) const { input_event e = {type, mods, cursor}; e.time = glfwGetTime(); return e; }
+    void push(input type) { queue.push(make_event(type, mods)); }
+    void push_key(input type, int mods, int key) { auto e = make_event(type, mods); e.key = key; queue.push(e); }
+    void push_button(input type, int mods, int button) { auto e = make_event(type, mods); e.button = button; queue.push(e); }
+    void push_delta(input type, const float2 & delta) { auto e = make_event(type, mods); e.delta = delta; queue.push(e); }
+    void push_codepoint(unsigned codepoint) { auto e = make_event(input::character, mods); e.codepoint = codepoint; queue.push(e); }
 };
 
 bool is_cursor_entered(GLFWwindow * window)
@@ -15,17 +98,45 @@ bool is_cursor_entered(GLFWwindow * window)
     return reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(window))->entered;
 }
 
-void install_input_callbacks(GLFWwindow * window, std::vector<input_event> & events)
+int2 get_window_size(GLFWwindow * window)
+{
+    auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(window));
+    return {buffer->width, buffer->height};
+}
+
+int2 get_framebuffer_size(GLFWwindow * window)
+{
+    auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(window));
+    return {buffer->framebuffer_width, buffer->framebuffer_height};
+}
+
+input_queue & install_input_callbacks(GLFWwindow * window, size_t capacity)
 {
     double2 cursor;
+    int2 size, framebuffer_size;
     glfwGetCursorPos(window, &cursor.x, &cursor.y);
-    glfwSetWindowUserPointer(window, new input_buffer{events, float2(cursor), 0, 0});
+    glfwGetWindowSize(window, &size.x, &size.y);
+    glfwGetFramebufferSize(window, &framebuffer_size.x, &framebuffer_size.y);
+    auto * buffer = new input_buffer(capacity, float2(cursor), size, framebuffer_size);
+    glfwSetWindowUserPointer(window, buffer);
+    glfwSetWindowSizeCallback(window, [](GLFWwindow * win, int width, int height)
+    {
+        auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(win));
+        buffer->width = width;
+        buffer->height = height;
+    });
+    glfwSetFramebufferSizeCallback(window, [](GLFWwindow * win, int width, int height)
+    {
+        auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(win));
+        buffer->framebuffer_width = width;
+        buffer->framebuffer_height = height;
+    });
     glfwSetCursorPosCallback(window, [](GLFWwindow * win, double x, double y)
     {
         auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(win));
-        const float2 cursor(double2(x,y));
-        buffer->events.push_back({input::cursor_motion, cursor, buffer->mods, cursor - buffer->cursor, 0, 0, {0,0}, 0});
+        const float2 cursor(double2(x,y)), motion = cursor - buffer->cursor;
         buffer->cursor = cursor;
+        buffer->push_delta(input::cursor_motion, motion);
     });
     glfwSetCursorEnterCallback(window, [](GLFWwindow * win, int entered)
     {
@@ -37,9 +148,9 @@ void install_input_callbacks(GLFWwindow * window, std::vector<input_event> & eve
         auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(win));
         switch(action)
         {
-        case GLFW_PRESS: buffer->events.push_back({input::key_down, buffer->cursor, mods, {0,0}, key, 0, {0,0}, 0}); break;
-        case GLFW_REPEAT: buffer->events.push_back({input::key_repeat, buffer->cursor, mods, {0,0}, key, 0, {0,0}, 0}); break;
-        case GLFW_RELEASE: buffer->events.push_back({input::key_up, buffer->cursor, mods, {0,0}, key, 0, {0,0}, 0}); break;
+        case GLFW_PRESS: buffer->push_key(input::key_down, mods, key); break;
+        case GLFW_REPEAT: buffer->push_key(input::key_repeat, mods, key); break;
+        case GLFW_RELEASE: buffer->push_key(input::key_up, mods, key); break;
         }
         buffer->mods = mods;
     });
@@ -48,34 +159,37 @@ void install_input_callbacks(GLFWwindow * window, std::vector<input_event> & eve
         auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(win));
         switch(action)
         {
-        case GLFW_PRESS: buffer->events.push_back({input::mouse_down, buffer->cursor, mods, {0,0}, 0, button, {0,0}, 0}); break;
-        case GLFW_RELEASE: buffer->events.push_back({input::mouse_up, buffer->cursor, mods, {0,0}, 0, button, {0,0}, 0}); break;
+        case GLFW_PRESS: buffer->push_button(input::mouse_down, mods, button); break;
+        case GLFW_RELEASE: buffer->push_button(input::mouse_up, mods, button); break;
         }
         buffer->mods = mods;
     });
     glfwSetScrollCallback(window, [](GLFWwindow * win, double x, double y)
     {
         auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(win));
-        buffer->events.push_back({input::scroll, buffer->cursor, buffer->mods, {0,0}, 0, 0, float2(double2(x,y)), 0});
+        buffer->push_delta(input::scroll, float2(double2(x,y)));
     });
     glfwSetCharCallback(window, [](GLFWwindow * win, unsigned codepoint)
     {
         auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(win));
-        buffer->events.push_back({input::character, buffer->cursor, buffer->mods, {0,0}, 0, 0, {0,0}, codepoint});
+        buffer->push_codepoint(codepoint);
     });
+    return buffer->queue;
 }
 
 void emit_empty_event(GLFWwindow * window)
 {
-    auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(window));
-    buffer->events.push_back({input::none, buffer->cursor, buffer->mods});
+    reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(window))->push(input::none);
 }
 
 void uninstall_input_callbacks(GLFWwindow * window)
 {
     if(auto * buffer = reinterpret_cast<input_buffer *>(glfwGetWindowUserPointer(window)))
     {
+        glfwSetWindowSizeCallback(window, nullptr);
+        glfwSetFramebufferSizeCallback(window, nullptr);
         glfwSetCursorPosCallback(window, nullptr);
+        glfwSetCursorEnterCallback(window, nullptr);
         glfwSetKeyCallback(window, nullptr);
         glfwSetMouseButtonCallback(window, nullptr);
         glfwSetScrollCallback(window, nullptr);
@@ -7,28 +7,67 @@
 #include "../thirdparty/linalg/linalg.h"
 using namespace linalg::aliases;
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <GLFW\glfw3.h>
 
 enum class input { none, cursor_motion, key_down, key_repeat, key_up, mouse_down, mouse_up, scroll, character };
 struct input_event
 {
-    input    type;      // Which input occurred during this event?
-    float2   cursor;    // The cursor location, specified in pixels, relative to the top left corner of the window
-    int      mods;      // Mod flags in play during the current event
-    float2   motion;    // The amount the cursor has moved, in pixels, during input::cursor_motion
-    int      key;       // Which key was pressed during input::key_down, held during input::key_repeat, or released during input::key_up
-    int      button;    // Which mouse button was pressed during input::mouse_down, or released during input::mouse_up
-    float2   scroll;    // The amount of scrolling which occurred during input::scroll
-    unsigned codepoint; // The unicode codepoint of the character typed during input::character
+    input    type;          // Which input occurred during this event?
+    int      mods;          // Mod flags in play during the current event
+    float2   cursor;        // The cursor location, specified in pixels, relative to the top left corner of the window
+    float2   delta;         // The amount the cursor has moved, in pixels, during input::cursor_motion, or the amount scrolled during input::scroll
+    union
+    {
+        int      key;       // Which key was pressed during input::key_down, held during input::key_repeat, or released during input::key_up
+        int      button;    // Which mouse button was pressed during input::mouse_down, or released during input::mouse_up
+        unsigned codepoint; // The unicode codepoint of the character typed during input::character
+    };
+    double   time;          // The time, in seconds as given by glfwGetTime(), at which the event was received
 
     bool is_down() const { return type == input::key_down || type == input::key_repeat || type == input::mouse_down; }
     bool is_up() const { return type == input::key_up || type == input::mouse_up; }
 };
 
-void install_input_callbacks(GLFWwindow * window, std::vector<input_event> & events);
-void emit_empty_event(GLFWwindow * window);
+// Fixed-capacity, lock-free ring buffer of input events, which never allocates after construction, and which may be filled by one thread
+// while another drains it. Cursor motion and scroll events are merged into the most recent event when it is of the same type and mods and
+// has not yet been taken by the consumer, and events which arrive while the queue is full are dropped and counted.
+class input_queue
+{
+    enum { slot_free, slot_ready, slot_reading, slot_merging };
+    struct slot { std::atomic<int> state; input_event event; };
+    std::unique_ptr<slot[]> slots;                  // Storage for the ring, whose size is a power of two
+    size_t mask;                                    // Size of the ring, minus one
+    std::atomic<size_t> head, tail;                 // Free-running counts of events popped and pushed, written only by the consumer and producer respectively
+    std::atomic<size_t> overflow_count;             // Number of events dropped because the queue was full
+    std::atomic<bool> waiting;                      // True while the consumer is blocked in wait()
+    std::mutex mutex;                               // Used only to put the consumer to sleep, never held by the producer for longer than a notification
+    std::condition_variable cv;
+public:
+    explicit input_queue(size_t capacity);
+
+    bool empty() const { return head == tail; }
+    size_t size() const { return tail - head; }
+    size_t get_capacity() const { return mask + 1; }
+    size_t get_overflow_count() const { return overflow_count; }
+
+    // Producer API, to be called only from the thread which processes window events
+    void push(const input_event & e);
+
+    // Consumer API, to be called only from a single thread, which may differ from the producer's
+    bool pop(input_event & e);  // Removes the oldest event and returns true, or returns false if the queue is empty
+    void wait();                // Blocks until the queue is not empty
+};
+
+input_queue & install_input_callbacks(GLFWwindow * window, size_t capacity = 256); // Returns the queue which receives the window's events, owned until uninstall_input_callbacks(...)
+void emit_empty_event(GLFWwindow * window); // Pushes an input::none event, which may be used to wake a consumer blocked in input_queue::wait()
 void uninstall_input_callbacks(GLFWwindow * window);
 bool is_cursor_entered(GLFWwindow * window);
+int2 get_window_size(GLFWwindow * window); // The window size last reported to the input callbacks, which unlike glfwGetWindowSize(...) may be queried from any thread
+int2 get_framebuffer_size(GLFWwindow * window); // The framebuffer size in pixels, which may differ from the window size on high-DPI displays, and may be queried from any thread
 
 #endif
\ No newline at end of file
@@ -5,24 +5,19 @@
 
 #include <cassert>
 #include <cctype>
+#include <cmath>
 #include <algorithm>
 #include <sstream>
+#include <stdexcept>
 
-bool widget_id::is_equal_to(const widget_id & r, int id) const
+void widget_id::push(int id)
 {
-    if(values.size() != r.values.size() + 1) return false;
-    for(size_t i=0; i<r.values.size(); ++i) if(values[i] != r.values[i]) return false;
-    return values.back() == id;
+    if(depth == max_depth) throw std::runtime_error("widgets nested too deeply");
+    prefixes[depth + 1] = hash(prefixes[depth], id);
+    ++depth;
 }
 
-bool widget_id::is_parent_of(const widget_id & r, int id) const
-{
-    if(values.size() < r.values.size() + 2) return false;
-    for(size_t i=0; i<r.values.size(); ++i) if(values[i] != r.values[i]) return false;
-    return values[r.values.size()] == id;
-}
-
-gui::gui() : in({})
+gui::gui(const std::string & font_path) : sprites(font_path), in({}), frame_queue(), frame_events_remaining(), frame_window_size()
 {
     std::vector<int> codepoints;
     for(int i=0xf000; i<=0xf295; ++i) codepoints.push_back(i);
@@ -30,14 +25,32 @@ gui::gui() : in({})
     sprites.sheet.prepare_texture();
 }
 
-void gui::begin_frame(const int2 & window_size, const input_event & e)
+static void begin_pass(gui & g)
+{
+    g.buffer.begin_frame(g.sprites, g.frame_window_size);
+    g.icon = cursor_icon::arrow;
+    g.clip_event = clipboard_event::none;
+    g.clipboard.clear();
+    g.current_id = {};
+}
+
+void gui::begin_frame(const int2 & window_size, input_queue & events)
 {
-    buffer.begin_frame(sprites, window_size);
-    icon = cursor_icon::arrow;
-    in = e;
-    clip_event = clipboard_event::none;
-    clipboard.clear();
-    current_id = {};
+    // Only the events already queued belong to this frame
+    frame_queue = &events;
+    frame_events_remaining = events.size();
+    frame_window_size = window_size;
+    if(frame_events_remaining && frame_queue->pop(in)) --frame_events_remaining;
+    else in = {input::none, in.mods, in.cursor};
+    begin_pass(*this);
+}
+
+bool gui::next_event()
+{
+    if(!frame_events_remaining || !frame_queue->pop(in)) return false;
+    --frame_events_remaining;
+    begin_pass(*this);
+    return true;
 }
 
 bool gui::is_cursor_over(const rect & r) const
@@ -85,13 +98,14 @@ static void next_char(const std::string & text, std::string::size_type & pos) {
 bool edit(gui & g, int id, const rect & r, std::string & text)
 {
     if(g.is_cursor_over(r)) g.icon = cursor_icon::ibeam;
-    if(g.check_click(id, r))
-    {
-        g.text_cursor = g.text_mark = g.sprites.default_font.get_cursor_pos(text, g.click_offset.x - 5);
-        g.focused_id = g.pressed_id;
-    }
+    const bool clicked = g.check_click(id, r);
+    if(clicked) g.focused_id = g.pressed_id;
     g.check_release(id);
-    if(g.is_pressed(id)) g.text_cursor = g.sprites.default_font.get_cursor_pos(text, g.get_cursor().x - r.x0 - 5);
+
+    // Measure the text once, and answer every caret and selection query below from the result
+    if(g.is_pressed(id) || g.is_focused(id)) g.text_layout.measure(g.sprites.default_font, text);
+    if(clicked) g.text_cursor = g.text_mark = g.text_layout.get_offset(static_cast<int>(g.click_offset.x - 5));
+    if(g.is_pressed(id)) g.text_cursor = g.text_layout.get_offset(static_cast<int>(g.get_cursor().x - r.x0 - 5));
 
     bool changed = false;
     if(g.is_focused(id))
@@ -209,13 +223,14 @@ bool edit(gui & g, int id, const rect & r, std::string & text)
     g.draw_rounded_rect(r, 4, {1,1,1,1});
     if(g.is_focused(id))
     {
+        if(changed) g.text_layout.measure(g.sprites.default_font, text);
         auto lo = std::min(g.text_cursor, g.text_mark), hi = std::max(g.text_cursor, g.text_mark);
-        g.draw_rect({tr.x0 + g.sprites.default_font.get_text_width(text.substr(0, lo)), tr.y0, tr.x0 + g.sprites.default_font.get_text_width(text.substr(0, hi)), tr.y1}, {1,1,0,1});
+        g.draw_rect({tr.x0 + g.text_layout.get_x(lo), tr.y0, tr.x0 + g.text_layout.get_x(hi), tr.y1}, {1,1,0,1});
     }
     g.draw_text({tr.x0, tr.y0}, text, {0,0,0,1});
     if(g.is_focused(id))
     {
-        int w = g.sprites.default_font.get_text_width(text.substr(0, g.text_cursor));
+        int w = g.text_layout.get_x(g.text_cursor);
         g.draw_rect({tr.x0+w, tr.y0, tr.x0+w+1, tr.y1}, {0,0,0,1});
     }
     return changed;
@@ -272,7 +287,7 @@ rect tabbed_frame(gui & g, rect r, const std::string & caption)
 rect vscroll_panel(gui & g, int id, const rect & r, int client_height, int & offset)
 {
     if(g.check_pressed(id)) offset = (static_cast<int>(g.get_cursor().y - g.click_offset.y) - r.y0) * client_height / r.height();
-    if(g.is_cursor_over(r)) offset -= static_cast<int>(g.in.scroll.y * 20);
+    if(g.is_cursor_over(r)) offset -= static_cast<int>(g.in.delta.y * 20);
     offset = std::min(offset, client_height - r.height());
     offset = std::max(offset, 0);
 
@@ -475,12 +490,12 @@ void scrollable_zoomable_background(gui & g, int id, transform_2d & view)
 {
     if(g.in.type == input::scroll)
     {
-        if(g.in.scroll.y > 0) view = transform_2d::scaling(1.25f, g.in.cursor) * view;
-        if(g.in.scroll.y < 0) view = transform_2d::scaling(0.80f, g.in.cursor) * view;
+        // Scroll events are merged as they arrive, so zoom by one step for each notch scrolled
+        view = transform_2d::scaling(std::pow(1.25f, g.in.delta.y), g.in.cursor) * view;
         if(view.scale > 0.85f && view.scale < 1.20f) view = transform_2d::scaling(1/view.scale, g.in.cursor) * view;
     }
 
     g.check_release(id);
-    if(g.is_pressed(id)) view = transform_2d::translation(g.in.motion) * view;
+    if(g.is_pressed(id)) view = transform_2d::translation(g.in.delta) * view;
     if(g.is_mouse_down(GLFW_MOUSE_BUTTON_LEFT)) g.set_pressed(id);
 }
\ No newline at end of file
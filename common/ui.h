@@ -11,14 +11,20 @@ enum class cursor_icon { arrow, ibeam, hresize, vresize };
 enum class clipboard_event { none, cut, copy, paste };
 struct menu_stack_frame { rect r; bool open, clicked; };
 
+// The path of IDs leading to a widget, stored as a hash of each prefix of the path, so that it can be compared in constant time without allocating
 class widget_id
 {
-    std::vector<int> values;
+    static const int max_depth = 32;
+    uint64_t prefixes[max_depth + 1];   // Hash of the first i IDs of the path, for each depth i
+    int depth;                          // Number of IDs in the path
+    static uint64_t hash(uint64_t prefix, int id) { const uint64_t h = (prefix ^ static_cast<uint32_t>(id)) * 0x9E3779B97F4A7C15ULL; return h ^ (h >> 32); }
 public:
-    bool is_equal_to(const widget_id & r, int id) const;
-    bool is_parent_of(const widget_id & r, int id) const;
-    void push(int id) { values.push_back(id); }
-    void pop() { values.pop_back(); }
+    widget_id() : depth(0) { prefixes[0] = 14695981039346656037ULL; }
+
+    bool is_equal_to(const widget_id & r, int id) const { return depth == r.depth + 1 && prefixes[depth] == hash(r.prefixes[r.depth], id); }
+    bool is_parent_of(const widget_id & r, int id) const { return depth >= r.depth + 2 && prefixes[r.depth + 1] == hash(r.prefixes[r.depth], id); }
+    void push(int id);
+    void pop() { --depth; }
 };
 
 struct gui
@@ -32,6 +38,9 @@ struct gui
     input_event in;                                 // Any event which occurs during this frame, may be none, but cursor and mods are always available
     clipboard_event clip_event;                     // Was a clipboard event requested during this frame?
     std::string clipboard;                          // Buffer used to receive or send information to the clipboard
+    input_queue * frame_queue;                      // Queue passed to begin_frame(...), from which each pass through the gui takes one event
+    size_t frame_events_remaining;                  // Number of events queued when the frame began which have not yet been processed
+    int2 frame_window_size;                         // Window size passed to begin_frame(...), used to restart the buffer on each pass
 
     // Focus state
     widget_id current_id;                           // The prefix of the ID of the current widget, managed by begin_children(...)/end_children(...) calls
@@ -42,12 +51,14 @@ struct gui
     float2 click_offset;                            // Offset from top-left of widget to clicked point, used for sliders, scrollbars, and draggables
     std::vector<menu_stack_frame> menu_stack;       // Information about expanded popup menus
     std::string::size_type text_cursor, text_mark;  // The bounds of the current selection in a text-edit widget
+    text_metrics text_layout;                       // Caret positions within the text of the focused or pressed text-edit widget
 
-    gui();
+    gui(const std::string & font_path = DRAW_2D_DEFAULT_FONT);
 
     // Scope API
-    void begin_frame(const int2 & window_size, const input_event & e);
-    void end_frame() { buffer.end_frame(); }
+    void begin_frame(const int2 & window_size, input_queue & events); // Begins a pass for the first of the events pending in the queue, or for an empty event if there are none
+    bool next_event(); // If events remain, restarts the frame to process the next one and returns true, otherwise returns false
+    void end_frame() { buffer.end_frame(); } // Only the output of the final pass is kept, so intermediate passes never reach the screen or damage tracking
     void begin_overlay() { buffer.begin_overlay(); }
     void end_overlay() { buffer.end_overlay(); }
     void begin_transform(const transform_2d & t) { buffer.begin_transform(t); }
@@ -73,7 +84,7 @@ struct gui
     bool is_shift_held() const { return (in.mods & GLFW_MOD_SHIFT) != 0; }
     bool is_control_held() const { return (in.mods & GLFW_MOD_CONTROL) != 0; }
     bool is_alt_held() const { return (in.mods & GLFW_MOD_ALT) != 0; }
-    void consume_input() { in = {input::none, in.cursor, in.mods}; }
+    void consume_input() { in = {input::none, in.mods, in.cursor}; }
 
     // API for determining clicked status
     bool is_pressed(int id) const { return pressed_id.is_equal_to(current_id, id); }
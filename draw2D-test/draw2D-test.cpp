@@ -81,11 +81,35 @@ struct edge
     }
 };
 
+// Zooming in can request corners and lines larger than a page of the sprite sheet, which must be clamped to a size that fits, rather than adding pages forever
+void test_oversized_shapes()
+{
+    sprite_library sprites;
+    draw_buffer_2d buffer;
+    int page_count = 0;
+    for(int size : {1021, 1500, 100000})
+    {
+        buffer.begin_frame(sprites, {1280, 720});
+        buffer.draw_circle({640, 360}, size, {1,1,1,1});
+        buffer.draw_rounded_rect({0, 0, 3*size, 3*size}, size, {1,1,1,1});
+        buffer.draw_line(float2(0, 0), float2(1280, 720), size, {1,1,1,1});
+        buffer.end_frame();
+        const int2 & page = sprites.sheet.get_texture_dims();
+        const auto & corner = sprites.sheet.get_sprite(sprites.get_corner_sprite(size));
+        assert(corner.dims.x + 2 <= page.x && corner.dims.y + 2 <= page.y);
+        assert(page_count == 0 || sprites.sheet.get_page_count() == page_count);
+        page_count = sprites.sheet.get_page_count();
+    }
+}
+
 GLuint make_sprite_texture_opengl(const sprite_sheet & sprites);
+void update_sprite_texture_opengl(sprite_sheet & sprites, GLuint tex);
 void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_texture);
 
 int main()
 {
+    test_oversized_shapes();
+
     sprite_library sprites;
     draw_buffer_2d buffer;
 
@@ -105,9 +129,13 @@ int main()
         {&nodes[0], 2, &nodes[1], 1, true}
     };
 
+    static bool window_damaged = true;
+    glfwSetWindowRefreshCallback(win, [](GLFWwindow *) { window_damaged = true; });
+    bool idle = false;
     while(!glfwWindowShouldClose(win))
     {
-        glfwPollEvents();
+        if(idle) glfwWaitEvents(); // Nothing is changing, so sleep until the window is resized or damaged
+        else glfwPollEvents();
 
         int w, h;
         glfwGetWindowSize(win, &w, &h);
@@ -115,10 +143,16 @@ int main()
         for(auto & n : nodes) n.draw(buffer);
         for(auto & e : edges) e.draw(buffer);
         buffer.end_frame();
+        update_sprite_texture_opengl(sprites.sheet, tex);
+
+        // If we produced the same frame as last time, the image already presented is still valid
+        idle = !buffer.is_frame_changed() && !window_damaged;
+        if(idle) continue;
 
         glClear(GL_COLOR_BUFFER_BIT);
         render_draw_buffer_opengl(buffer, tex);
         glfwSwapBuffers(win);
+        window_damaged = false;
     }
 
     glfwDestroyWindow(win);
@@ -128,16 +162,40 @@ int main()
 
 GLuint make_sprite_texture_opengl(const sprite_sheet & sprites)
 {
+    // Without texture arrays, the pages of the sprite sheet are stacked vertically in a single texture
     GLuint tex;
     glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, sprites.get_texture_dims().x, sprites.get_texture_dims().y, 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, sprites.get_texture_dims().x, sprites.get_texture_dims().y * sprites.get_page_count(), 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glBindTexture(GL_TEXTURE_2D, 0);
     return tex;
 }
 
+void update_sprite_texture_opengl(sprite_sheet & sprites, GLuint tex)
+{
+    // Upload only the region of each page which changed, unless the atlas grew or gained a page, in which case the whole atlas must be uploaded again
+    const rect & r = sprites.get_dirty_rect();
+    if(r.x0 >= r.x1 || r.y0 >= r.y1) return;
+    const int2 & dims = sprites.get_texture_dims();
+    const int2 & pages = sprites.get_dirty_pages();
+    glBindTexture(GL_TEXTURE_2D, tex);
+    if(r.width() == dims.x && r.height() == dims.y) glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, dims.x, dims.y * sprites.get_page_count(), 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
+    else
+    {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, dims.x);
+        for(int page=pages.x; page<pages.y; ++page)
+        {
+            const int y0 = page*dims.y + r.y0;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, r.x0, y0, r.width(), r.height(), GL_ALPHA, GL_UNSIGNED_BYTE, reinterpret_cast<const uint8_t *>(sprites.get_texture_data()) + y0*dims.x + r.x0);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    sprites.clear_dirty_rect();
+}
+
 void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_texture)
 {
     glPushAttrib(GL_ALL_ATTRIB_BITS);
@@ -145,11 +203,21 @@ void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_text
     glBindTexture(GL_TEXTURE_2D, sprite_texture);
     glEnable(GL_BLEND); 
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glMatrixMode(GL_TEXTURE);
+    glPushMatrix();
+    glLoadIdentity();
+    glScalef(1, 1.0f / buffer.get_library().sheet.get_page_count(), 1); // Map page + t onto the stacked pages
     for(GLenum array : {GL_VERTEX_ARRAY, GL_TEXTURE_COORD_ARRAY, GL_COLOR_ARRAY}) glEnableClientState(array);
-    glVertexPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->position);
-    glTexCoordPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->texcoord);
-    glColorPointer(4, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->color);
-    glDrawElements(GL_TRIANGLES, buffer.get_indices().size(), GL_UNSIGNED_SHORT, buffer.get_indices().data());
+    for(auto & batch : buffer.get_batches())
+    {
+        const auto * vertices = buffer.get_vertices().data() + batch.first_vertex;
+        glVertexPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->position);
+        glTexCoordPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->texcoord);
+        glColorPointer(4, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->color);
+        glDrawElements(GL_TRIANGLES, batch.index_count, GL_UNSIGNED_SHORT, batch.indices);
+    }
     for(GLenum array : {GL_VERTEX_ARRAY, GL_TEXTURE_COORD_ARRAY, GL_COLOR_ARRAY}) glDisableClientState(array);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
     glPopAttrib();
 }
\ No newline at end of file
@@ -1,8 +1,11 @@
 // This is free and unencumbered software released into the public domain.
 // For more information, please refer to <http://unlicense.org>
 
+#include <GL\glew.h>
 #include "ui.h"
 
+#include <thread>
+
 void draw_tooltip(draw_buffer_2d & buffer, const int2 & loc, utf8::string_view text)
 {
     int w = buffer.get_library().default_font.get_text_width(text), h = buffer.get_library().default_font.line_height;
@@ -321,46 +324,85 @@ struct graph
 };
 
 GLuint make_sprite_texture_opengl(const sprite_sheet & sprites);
-void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_texture);
+GLuint make_sprite_program_opengl();
+void update_sprite_texture_opengl(sprite_sheet & sprites, GLuint tex);
+void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_texture, GLuint sprite_program);
+
+struct framebuffer_opengl { GLuint fbo, tex; int2 dims; }; // An offscreen color buffer which holds the last frame drawn, whatever happens to the window
+bool resize_framebuffer_opengl(framebuffer_opengl & fb, const int2 & dims); // Returns true if the framebuffer was (re)created, in which case its contents are undefined
+void redraw_regions_opengl(const draw_buffer_2d & buffer, const framebuffer_opengl & fb, const std::vector<rect> & regions, const int2 & window_size, GLuint sprite_texture, GLuint sprite_program);
+void present_framebuffer_opengl(GLFWwindow * window, const framebuffer_opengl & fb);
 
 int main()
 {
-    gui g;
-
     glfwInit();
     auto win = glfwCreateWindow(1280, 720, "Graph Editor", nullptr, nullptr);
-    std::vector<input_event> events;
-    install_input_callbacks(win, events);
-    glfwMakeContextCurrent(win);
-
-    GLuint tex = make_sprite_texture_opengl(g.sprites.sheet);
+    auto & events = install_input_callbacks(win);
 
-    graph gr;
-    gr.view = {1,{0,0}};
-    gr.nodes = {
-        new node{&types[0], {50,50}},
-        new node{&types[1], {650,150}}
-    };
-    gr.nodes[1]->input_edges[1] = edge(gr.nodes[0], 0);
-
-    while(!glfwWindowShouldClose(win))
+    // Window events can only be processed on the main thread, so it does nothing else, and input is received and timestamped as soon as it
+    // arrives, however long a frame takes. The gui is run and rendered on a thread of its own, which owns the OpenGL context.
+    static std::atomic<bool> window_damaged(true);
+    glfwSetWindowRefreshCallback(win, [](GLFWwindow * win) { window_damaged = true; emit_empty_event(win); });
+    std::thread render_thread([win, &events]()
     {
-        g.icon = cursor_icon::arrow;
-        glfwPollEvents();
-
-        int2 window_size;
-        glfwGetWindowSize(win, &window_size.x, &window_size.y);
-        if(events.empty()) emit_empty_event(win);
-        g.begin_frame(window_size, events.front());
-        events.erase(begin(events));
+        gui g;
+        glfwMakeContextCurrent(win);
+        glewInit();
+
+        // Draw text from distance fields, so that it stays crisp at every zoom level of the graph, from a single set of glyphs
+        std::vector<int> codepoints;
+        for(int i=32; i<256; ++i) codepoints.push_back(i);
+        g.sprites.default_font.load_glyphs(DRAW_2D_DEFAULT_FONT, 14, codepoints, true);
+        if(!g.sprites.load_cache("graph-editor.cache")) g.sprites.default_font.preload_glyphs(codepoints);
+
+        GLuint tex = make_sprite_texture_opengl(g.sprites.sheet);
+        GLuint program = make_sprite_program_opengl();
+
+        graph gr;
+        gr.view = {1,{0,0}};
+        gr.nodes = {
+            new node{&types[0], {50,50}},
+            new node{&types[1], {650,150}}
+        };
+        gr.nodes[1]->input_edges[1] = edge(gr.nodes[0], 0);
+
+        g.buffer.set_damage_tracking(true);
+        framebuffer_opengl frame = {};
+        bool idle = false;
+        while(!glfwWindowShouldClose(win))
+        {
+            g.icon = cursor_icon::arrow;
+            if(idle) events.wait(); // Nothing is changing, so sleep until the next input arrives
+
+            const int2 window_size = get_window_size(win), framebuffer_size = get_framebuffer_size(win);
+            g.begin_frame(window_size, events);
+            do gr.on_gui(g); while(g.next_event()); // Process every event received since the last frame, drawing only the final pass
+            g.end_frame();
+            update_sprite_texture_opengl(g.sprites.sheet, tex);
+
+            // If the gui produced the same frame as last time, the image already presented is still valid, and if this happens without any input, we are idle
+            const bool damaged = window_damaged.exchange(false);
+            const bool resized = resize_framebuffer_opengl(frame, framebuffer_size);
+            const bool redraw = g.buffer.is_frame_changed() || damaged || resized;
+            idle = !redraw && events.empty() && g.in.type == input::none;
+            if(!redraw) continue;
+
+            // The framebuffer retains the previous frame, so only the regions which changed are drawn again, unless the framebuffer is new or the
+            // window was damaged, in which case everything is drawn. Either way, the whole frame is then presented.
+            if(damaged || resized) redraw_regions_opengl(g.buffer, frame, {{0, 0, window_size.x, window_size.y}}, window_size, tex, program);
+            else redraw_regions_opengl(g.buffer, frame, g.buffer.get_damage_rects(), window_size, tex, program);
+            present_framebuffer_opengl(win, frame);
+        }
 
-        gr.on_gui(g);
-        g.end_frame();
+        g.sprites.save_cache("graph-editor.cache");
+        glDeleteFramebuffers(1, &frame.fbo);
+        glDeleteTextures(1, &frame.tex);
+        glfwMakeContextCurrent(nullptr);
+    });
 
-        glClear(GL_COLOR_BUFFER_BIT);
-        render_draw_buffer_opengl(g.buffer, tex);
-        glfwSwapBuffers(win);
-    }
+    while(!glfwWindowShouldClose(win)) glfwWaitEvents();
+    emit_empty_event(win); // Wake the render thread, in case it is waiting for input, so that it sees the window closing
+    render_thread.join();
 
     uninstall_input_callbacks(win);
     glfwDestroyWindow(win);
@@ -370,28 +412,163 @@ int main()
 
 GLuint make_sprite_texture_opengl(const sprite_sheet & sprites)
 {
+    // Each page of the sprite sheet is a layer of a texture array
     GLuint tex;
     glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, sprites.get_texture_dims().x, sprites.get_texture_dims().y, 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_ALPHA, sprites.get_texture_dims().x, sprites.get_texture_dims().y, sprites.get_page_count(), 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
     return tex;
 }
 
-void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_texture)
+GLuint make_sprite_program_opengl()
+{
+    // Texcoords with negative s refer to distance field sprites, which are thresholded at 0.5, with a ramp one pixel wide for antialiasing,
+    // and the integer part of t selects the layer of the texture array
+    const char * vertex_source = "void main() { gl_Position = gl_Vertex; gl_TexCoord[0] = gl_MultiTexCoord0; gl_FrontColor = gl_Color; }";
+    const char * fragment_source = R"(
+        #extension GL_EXT_texture_array : require
+        uniform sampler2DArray u_texture;
+        void main()
+        {
+            float t = gl_TexCoord[0].y;
+            float a = texture2DArray(u_texture, vec3(abs(gl_TexCoord[0].x), fract(t), floor(t))).a, w = length(vec2(dFdx(a), dFdy(a))) * 0.7;
+            if(gl_TexCoord[0].x < 0.0) a = smoothstep(0.5 - w, 0.5 + w, a);
+            gl_FragColor = vec4(gl_Color.rgb, gl_Color.a * a);
+        })";
+    GLuint program = glCreateProgram();
+    for(auto shader : {std::make_pair(GL_VERTEX_SHADER, vertex_source), std::make_pair(GL_FRAGMENT_SHADER, fragment_source)})
+    {
+        GLuint object = glCreateShader(shader.first);
+        glShaderSource(object, 1, &shader.second, nullptr);
+        glCompileShader(object);
+        GLint status;
+        glGetShaderiv(object, GL_COMPILE_STATUS, &status);
+        if(status == GL_FALSE) throw std::runtime_error("failed to compile sprite shader");
+        glAttachShader(program, object);
+        glDeleteShader(object);
+    }
+    glLinkProgram(program);
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(status == GL_FALSE) throw std::runtime_error("failed to link sprite program");
+    return program;
+}
+
+void update_sprite_texture_opengl(sprite_sheet & sprites, GLuint tex)
+{
+    // Upload only the region of each page which changed, unless the atlas grew or gained a page, in which case the whole atlas must be uploaded again
+    const rect & r = sprites.get_dirty_rect();
+    if(r.x0 >= r.x1 || r.y0 >= r.y1) return;
+    const int2 & dims = sprites.get_texture_dims();
+    const int2 & pages = sprites.get_dirty_pages();
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+    if(r.width() == dims.x && r.height() == dims.y) glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_ALPHA, dims.x, dims.y, sprites.get_page_count(), 0, GL_ALPHA, GL_UNSIGNED_BYTE, sprites.get_texture_data());
+    else
+    {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, dims.x);
+        for(int page=pages.x; page<pages.y; ++page)
+        {
+            const uint8_t * pixels = reinterpret_cast<const uint8_t *>(sprites.get_texture_data()) + (page*dims.y + r.y0)*dims.x + r.x0;
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, r.x0, r.y0, page, r.width(), r.height(), 1, GL_ALPHA, GL_UNSIGNED_BYTE, pixels);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    sprites.clear_dirty_rect();
+}
+
+void render_draw_buffer_opengl(const draw_buffer_2d & buffer, GLuint sprite_texture, GLuint sprite_program)
 {
     glPushAttrib(GL_ALL_ATTRIB_BITS);
-    glEnable(GL_TEXTURE_2D); 
-    glBindTexture(GL_TEXTURE_2D, sprite_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, sprite_texture);
+    glUseProgram(sprite_program);
     glEnable(GL_BLEND); 
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     for(GLenum array : {GL_VERTEX_ARRAY, GL_TEXTURE_COORD_ARRAY, GL_COLOR_ARRAY}) glEnableClientState(array);
-    glVertexPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->position);
-    glTexCoordPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->texcoord);
-    glColorPointer(4, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &buffer.get_vertices().data()->color);
-    glDrawElements(GL_TRIANGLES, buffer.get_indices().size(), GL_UNSIGNED_SHORT, buffer.get_indices().data());
+    for(auto & batch : buffer.get_batches())
+    {
+        const auto * vertices = buffer.get_vertices().data() + batch.first_vertex;
+        glVertexPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->position);
+        glTexCoordPointer(2, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->texcoord);
+        glColorPointer(4, GL_FLOAT, sizeof(draw_buffer_2d::vertex), &vertices->color);
+        glDrawElements(GL_TRIANGLES, batch.index_count, GL_UNSIGNED_SHORT, batch.indices);
+    }
     for(GLenum array : {GL_VERTEX_ARRAY, GL_TEXTURE_COORD_ARRAY, GL_COLOR_ARRAY}) glDisableClientState(array);
+    glUseProgram(0);
     glPopAttrib();
-}
\ No newline at end of file
+}
+
+bool resize_framebuffer_opengl(framebuffer_opengl & fb, const int2 & dims)
+{
+    if(fb.fbo && fb.dims == dims) return false;
+    if(!fb.fbo)
+    {
+        glGenFramebuffers(1, &fb.fbo);
+        glGenTextures(1, &fb.tex);
+    }
+    fb.dims = dims;
+    glBindTexture(GL_TEXTURE_2D, fb.tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, std::max(dims.x, 1), std::max(dims.y, 1), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, fb.tex, 0);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if(status != GL_FRAMEBUFFER_COMPLETE) throw std::runtime_error("failed to create framebuffer");
+    return true;
+}
+
+static std::vector<rect> merge_nearby_rects(std::vector<rect> rects)
+{
+    // Each region costs a pass over the whole draw buffer, so merge any two regions whose bounds are no more than twice the area they cover
+    auto area = [](const rect & r) { return static_cast<int64_t>(r.width()) * r.height(); };
+    for(size_t i=0; i<rects.size(); ++i)
+    {
+        for(size_t j=i+1; j<rects.size(); ++j)
+        {
+            const rect u = {std::min(rects[i].x0, rects[j].x0), std::min(rects[i].y0, rects[j].y0), std::max(rects[i].x1, rects[j].x1), std::max(rects[i].y1, rects[j].y1)};
+            if(area(u) > 2 * (area(rects[i]) + area(rects[j]))) continue;
+            rects[i] = u;
+            rects.erase(rects.begin() + j);
+            j = i; // The grown region may now be close to regions already passed over
+        }
+    }
+    return rects;
+}
+
+void redraw_regions_opengl(const draw_buffer_2d & buffer, const framebuffer_opengl & fb, const std::vector<rect> & regions, const int2 & window_size, GLuint sprite_texture, GLuint sprite_program)
+{
+    // Regions are given in window coordinates, and are scaled out to whole pixels of the framebuffer, which is larger on high-DPI displays.
+    // Everything outside of them keeps its contents from the previous frame.
+    if(window_size.x <= 0 || window_size.y <= 0) return;
+    const double2 scale = double2(fb.dims) / double2(window_size);
+    glBindFramebuffer(GL_FRAMEBUFFER, fb.fbo);
+    glViewport(0, 0, fb.dims.x, fb.dims.y);
+    glEnable(GL_SCISSOR_TEST);
+    for(auto & r : merge_nearby_rects(regions))
+    {
+        if(r.x0 >= r.x1 || r.y0 >= r.y1) continue;
+        const int x0 = static_cast<int>(std::floor(r.x0 * scale.x)), x1 = static_cast<int>(std::ceil(r.x1 * scale.x));
+        const int y0 = static_cast<int>(std::floor(r.y0 * scale.y)), y1 = static_cast<int>(std::ceil(r.y1 * scale.y));
+        glScissor(x0, fb.dims.y - y1, x1 - x0, y1 - y0);
+        glClear(GL_COLOR_BUFFER_BIT);
+        render_draw_buffer_opengl(buffer, sprite_texture, sprite_program);
+    }
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void present_framebuffer_opengl(GLFWwindow * window, const framebuffer_opengl & fb)
+{
+    // The back buffer is undefined after a swap, so the whole retained frame is copied into it every time
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fb.fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, fb.dims.x, fb.dims.y, 0, 0, fb.dims.x, fb.dims.y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glfwSwapBuffers(window);
+}
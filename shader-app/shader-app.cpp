@@ -120,8 +120,7 @@ int main(int argc, char * argv[]) try
     auto g_cylinder = make_draw_mesh(ctx, cylinder);
 
     auto win = gfx::create_window(*ctx, {1280, 720}, "Shader App");
-    std::vector<input_event> events;
-    install_input_callbacks(win, events);
+    auto & events = install_input_callbacks(win);
 
     std::vector<scene_object> objects = {
         {"Ground", &ground, g_ground, {0,0,0}, {0.8,0.8,0.8}},
@@ -147,7 +146,8 @@ int main(int argc, char * argv[]) try
         }
         t0 = t1;
 
-        for(const auto & e : events) switch(e.type)
+        input_event e;
+        while(events.pop(e)) switch(e.type)
         {
         case input::key_down: case input::key_up:            
             switch(e.key)
@@ -168,12 +168,11 @@ int main(int argc, char * argv[]) try
         case input::cursor_motion:
             if(mr)
             {
-                cam.yaw -= e.motion.x * 0.01f;
-                cam.pitch -= e.motion.y * 0.01f;
+                cam.yaw -= e.delta.x * 0.01f;
+                cam.pitch -= e.delta.y * 0.01f;
             }
             break;
         }
-        events.clear();
 
         if(mr)
         {